@@ -15,6 +15,17 @@
 #include <sys/ioctl.h>
 #include <stdarg.h>
 #include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/uio.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 #include "syntax.cpp"
 
 using namespace std;
@@ -23,23 +34,137 @@ using namespace std;
 void editorSetStatusMessage(const char *fmt, ...);
 void editorRefreshScreen();
 char *editorPrompt(const char *prompt, void (*callback)(const char *, int));
+void editorUpdateRow(struct erow *row);
+void editorRowRender(struct erow *row);
+void editorSyntaxIdle();
+int editorSearchPoll();
+int editorSavePoll();
+void editorSaveWait();
+void editorTrigramStop();
+void editorHighlightStart();
+void editorHighlightStop();
+int editorHighlightPoll();
+void editorSearchForget(struct erow *row);
+char *editorSearchTake();
+void editorSearchStart(const char *query);
 
 //*** Defines ***/
 #define PICKLE_VERSION "0.0.1"
 #define PICKLE_TAB_STOP 4
 #define CTRL_KEY(k) ((k) & 0x1f)
 #define PICKLE_QUIT_TIMES 2
+#define PICKLE_INDEX_CHUNK (4 << 20)
+#define PICKLE_INDEX_THREADS 8
+#define PICKLE_HL_SLICE 4096
+#define PICKLE_HL_CHUNK (1 << 16)
+#define PICKLE_HL_POLL 50
+#define PICKLE_INPUT_RING (1 << 16)
+#define PICKLE_ESC_TIMEOUT 100
+#define PICKLE_INDEX_POLL 50
+#define PICKLE_PASTE_TIMEOUT 1000
+#define PICKLE_SEARCH_BLOCK (1 << 20)
+#define PICKLE_SEARCH_POLL 20
+#define PICKLE_SEARCH_SAMPLE (256 << 10)
+#define PICKLE_SAVE_IOV 1024
+#define PICKLE_SAVE_CHUNK (4 << 20)
+#define PICKLE_SAVE_POLL 100
+#define PICKLE_JOURNAL_SYNC 200
+#define PICKLE_JOURNAL_MAGIC "PKJRNL01"
+#define PICKLE_UNDO_MAX (64 << 20)
+#define PICKLE_SLAB_SIZE (1 << 20)
+#define PICKLE_SLAB_PURGE 8
+#define PICKLE_ROW_CLASSES 44
+#define PICKLE_ROW_KEEP 4096
+#define PICKLE_LONG_ROW 4096
+#define PICKLE_TRIGRAM_MIN (32 << 20)
+#define PICKLE_TRIGRAM_BLOCK (64 << 10)
+#define PICKLE_TRIGRAM_OVERLAP 256
+#define PICKLE_TRIGRAM_MAGIC "PKTRIGR1"
+
+// A span of `len` rendered characters from `start` on that share highlight
+// `hl`. A row keeps the runs of everything not HL_NORMAL, in order.
+typedef struct hlRun {
+  int start;
+  int len;
+  unsigned char hl;
+} hlRun;
 
 typedef struct erow {
-  int idx;
   int size;
   int rsize;
   char *chars;
   char *render;
-  unsigned char *highlight;
+  hlRun *hl;
+  int nhl;
+  int hl_in;
   int hl_open_comment;
+  int mapped;
+  int tabs;
+  int charscap, rendercap, hlcap;
 } erow;
 
+// A node of the row treap. A node either holds one loaded row, or a run of
+// `lines` untouched lines of the mapped file starting at `fileline` (-1 for a
+// loaded row). `count` is the number of rows in its subtree, which is what
+// positional lookups descend on. A node is `dirty` when its highlighting has to
+// be looked at again: a loaded row whose render/highlight are out of date, or a
+// run whose first line may no longer start in the lexer state recorded for it.
+// `ndirty` counts the dirty nodes in the subtree.
+typedef struct rowNode {
+  erow row;
+  struct rowNode *left, *right, *parent;
+  unsigned int prio;
+  int count;
+  int dirty;
+  int ndirty;
+  int lines;
+  int fileline;
+} rowNode;
+
+#define ROW_NODE(r) ((rowNode*)((char*)(r) - offsetof(rowNode, row)))
+
+// The head of a slab: the next slab, and how many buffers and nodes carved
+// out of it are in use.
+typedef struct storeSlab {
+  struct storeSlab *next;
+  long live;
+} storeSlab;
+
+#define STORE_SLAB(p) ((storeSlab*)((uintptr_t)(p) & ~(uintptr_t)(PICKLE_SLAB_SIZE - 1)))
+
+// Slabs that row buffers and nodes are carved out of, with a free list per
+// buffer size class, and what is in use, for reporting. `current` is the
+// slab being carved from, and `empty` counts the others with nothing live.
+struct rowStore {
+  void *free[PICKLE_ROW_CLASSES];
+  void *freenodes;
+  storeSlab *slabs;
+  storeSlab *current;
+  char *slab;
+  size_t slableft;
+  int empty;
+  size_t slabbytes;
+  size_t inuse;
+  size_t large;
+  long buffers;
+  long nodes;
+  long borrowed;
+};
+
+// The row last edited in place while it was up to date, and the span of its
+// chars [from, to) changed since, which used to be `delta` bytes shorter.
+struct rowEdit {
+  erow *row;
+  int from, to;
+  int delta;
+};
+
+// From line `line` on, the line table's offsets have `high` as their upper
+// 32 bits.
+typedef struct lineWrap {
+  int line;
+  unsigned int high;
+} lineWrap;
 
 enum keys {
   BACKSPACE = 127,
@@ -51,7 +176,9 @@ enum keys {
   HOME_KEY,
   END_KEY,
   PAGE_UP,
-  PAGE_DOWN
+  PAGE_DOWN,
+  PASTE_START,
+  PASTE_END
 };
 
 enum editorHighLight {
@@ -65,12 +192,55 @@ enum editorHighLight {
   HL_MATCH
 };
 
+// One character cell of the screen: the byte shown and how it is shown, as a
+// highlight class, optionally combined with CELL_INVERSE.
+typedef struct screenCell {
+  char ch;
+  unsigned char attr;
+} screenCell;
+
+#define CELL_INVERSE 0x80
+
+// Output buffer for a frame. It is kept across frames and grows
+// geometrically, so a refresh normally does no allocation at all.
+struct appendBuffer{
+  char *b;
+  size_t len;
+  size_t cap;
+};
+
 struct pickleConfig {
   int trash;
   int cx, cy, rx;
   int rowoff, coloff;
   int screenrows, screencols, numrows;
-  erow *row;
+  rowNode *rows;
+  char *map;
+  size_t mapsize;
+  int mapheap;
+  unsigned int *lineoff;
+  lineWrap *linewrap;
+  int nlinewrap;
+  int maplines;
+  unsigned char *linestate;
+  int linestatecap;
+  struct lineIndexer *indexer;
+  struct searchJob *search;
+  struct saveJob *save;
+  struct journal *journal;
+  struct undoLog *undo;
+  struct rowStore store;
+  struct rowEdit edit;
+  struct trigramIndex *trigram;
+  struct highlightJob *highlighter;
+  int searchregex;
+  screenCell *frame, *shadow;
+  int framerows, framecols;
+  int shadowvalid;
+  int shadowrowoff;
+  struct appendBuffer out;
+  char input[PICKLE_INPUT_RING];
+  unsigned int inhead, intail;
   char *filename;
   char statusmsg[80];
   time_t statusmsg_time;
@@ -85,162 +255,2626 @@ void die(const char *s) {
   write(STDOUT_FILENO, "\x1b[2J", 4);
   write(STDOUT_FILENO, "\x1b[H", 3);
 
-  perror(s);
-  exit(1);
+  perror(s);
+  exit(1);
+}
+
+// Disable Raw Mode
+void disableRawMode() {
+  write(STDOUT_FILENO, "\x1b[?2004l", 8);
+  tcsetattr(STDIN_FILENO, TCSAFLUSH, &P.orig_termios);
+}
+
+// Input Flags
+void enableRawMode() {
+  if (tcgetattr(STDIN_FILENO, &P.orig_termios) == -1){
+    die("tcgetattr");
+  }
+  atexit(disableRawMode);
+
+  #define CTRL_KEY(k) ((k) & 0x1f)
+
+  struct termios raw = P.orig_termios;
+
+  raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+  raw.c_oflag &= ~(OPOST);
+  raw.c_cflag |= (CS8);
+  raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+  raw.c_cc[VMIN] = 0;
+  raw.c_cc[VTIME] = 0;
+
+  if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) die("tcsetattr");
+
+  // Bracketed paste: pasted text arrives between \x1b[200~ and \x1b[201~.
+  write(STDOUT_FILENO, "\x1b[?2004h", 8);
+}
+
+/*** row storage ***/
+
+// Loaded rows keep their chars, render and highlight in buffers carved out
+// of big slabs instead of malloc'ing each one. Buffers come in size classes
+// from 16 bytes to 64 KB: steps of 16 bytes up to 128, then four steps per
+// doubling, so no more than a fifth of a buffer is slack, and a row being
+// typed into only moves when it outgrows its class. A freed buffer goes on
+// its class's free list to be handed out again. Bigger buffers go to malloc
+// with some slack. Row nodes are carved out of the same slabs and recycled
+// through a list of their own.
+//
+// Slabs are mapped aligned to their size, so a buffer finds its slab's
+// head by masking its address. Once PICKLE_SLAB_PURGE slabs have nothing
+// live in them, as after closing a big paste or reloading a file after a
+// save, they are taken off the free lists and unmapped.
+
+int storeClass(int n) {
+  if (n <= 128) return n <= 16 ? 0 : (n + 15) / 16 - 1;
+  int k = 31 - __builtin_clz(n - 1);
+  int c = 8 + (k - 7) * 4 + (n - 1 - (1 << k)) / (1 << (k - 2));
+  return c < PICKLE_ROW_CLASSES ? c : -1;
+}
+
+int storeClassSize(int c) {
+  if (c < 8) return (c + 1) * 16;
+  int k = 7 + (c - 8) / 4;
+  return (1 << k) + ((c - 8) % 4 + 1) * (1 << (k - 2));
+}
+
+storeSlab *storeSlabNew() {
+  size_t size = PICKLE_SLAB_SIZE;
+  char *p = (char*) mmap(NULL, 2 * size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) die("mmap");
+  char *start = (char*) STORE_SLAB(p + size - 1);
+  if (start > p) munmap(p, start - p);
+  if (p + size > start) munmap(start + size, p + size - start);
+  storeSlab *slab = (storeSlab*) start;
+  slab -> next = P.store.slabs;
+  slab -> live = 0;
+  P.store.slabs = slab;
+  P.store.slabbytes += size;
+  return slab;
+}
+
+// Drops every slab with nothing live in it, except the one being carved.
+void storePurge() {
+  struct rowStore *s = &P.store;
+  for (int c = 0; c <= PICKLE_ROW_CLASSES; c++) {
+    void **link = c < PICKLE_ROW_CLASSES ? &s -> free[c] : &s -> freenodes;
+    while (*link) {
+      storeSlab *slab = STORE_SLAB(*link);
+      if (slab -> live == 0 && slab != s -> current) *link = *(void**) *link;
+      else link = (void**) *link;
+    }
+  }
+  storeSlab **link = &s -> slabs;
+  while (*link) {
+    storeSlab *slab = *link;
+    if (slab -> live == 0 && slab != s -> current) {
+      *link = slab -> next;
+      munmap(slab, PICKLE_SLAB_SIZE);
+      s -> slabbytes -= PICKLE_SLAB_SIZE;
+    } else {
+      link = &slab -> next;
+    }
+  }
+  s -> empty = 0;
+}
+
+// Counts a block handed out of, or given back to, the slab it lives in.
+void storeTake(void *p) {
+  storeSlab *slab = STORE_SLAB(p);
+  if (slab -> live++ == 0 && slab != P.store.current) P.store.empty--;
+}
+
+void storeGive(void *p) {
+  struct rowStore *s = &P.store;
+  storeSlab *slab = STORE_SLAB(p);
+  if (--slab -> live == 0 && slab != s -> current && ++s -> empty >= PICKLE_SLAB_PURGE)
+    storePurge();
+}
+
+void *storeCarve(size_t n) {
+  struct rowStore *s = &P.store;
+  n = (n + 15) & ~(size_t) 15;
+  if (s -> slableft < n) {
+    storeSlab *old = s -> current;
+    s -> current = storeSlabNew();
+    s -> slab = (char*) s -> current + ((sizeof(storeSlab) + 15) & ~(size_t) 15);
+    s -> slableft = (char*) s -> current + PICKLE_SLAB_SIZE - s -> slab;
+    if (old && old -> live == 0 && ++s -> empty >= PICKLE_SLAB_PURGE) storePurge();
+  }
+  void *p = s -> slab;
+  s -> slab += n;
+  s -> slableft -= n;
+  s -> current -> live++;
+  return p;
+}
+
+// Returns a buffer of at least `n` bytes, and its actual size in `*cap`.
+char *storeAlloc(int n, int *cap) {
+  struct rowStore *s = &P.store;
+  int c = storeClass(n);
+  if (c < 0) {
+    *cap = n + n / 2;
+    s -> large += *cap;
+    return (char*) malloc(*cap);
+  }
+  *cap = storeClassSize(c);
+  s -> inuse += *cap;
+  s -> buffers++;
+  void *p = s -> free[c];
+  if (p == NULL) return (char*) storeCarve(*cap);
+  s -> free[c] = *(void**) p;
+  storeTake(p);
+  return (char*) p;
+}
+
+void storeFree(void *p, int cap) {
+  struct rowStore *s = &P.store;
+  if (p == NULL) return;
+  int c = storeClass(cap);
+  if (c < 0) {
+    s -> large -= cap;
+    free(p);
+    return;
+  }
+  s -> inuse -= cap;
+  s -> buffers--;
+  *(void**) p = s -> free[c];
+  s -> free[c] = p;
+  storeGive(p);
+}
+
+// Makes `p` hold at least `need` bytes, keeping its first `keep`.
+char *storeReserve(char *p, int *cap, int need, int keep) {
+  if (p && need <= *cap) return p;
+  int newcap;
+  char *q = storeAlloc(need, &newcap);
+  if (keep) memcpy(q, p, keep);
+  storeFree(p, *cap);
+  *cap = newcap;
+  return q;
+}
+
+rowNode *storeNode() {
+  struct rowStore *s = &P.store;
+  void *p = s -> freenodes;
+  if (p) {
+    s -> freenodes = *(void**) p;
+    storeTake(p);
+  } else {
+    p = storeCarve(sizeof(rowNode));
+  }
+  s -> nodes++;
+  memset(p, 0, sizeof(rowNode));
+  return (rowNode*) p;
+}
+
+void storeFreeNode(rowNode *n) {
+  struct rowStore *s = &P.store;
+  *(void**) n = s -> freenodes;
+  s -> freenodes = n;
+  s -> nodes--;
+  storeGive(n);
+}
+
+void editorFreeRow(erow *row) {
+  editorSearchForget(row);
+  if (P.edit.row == row) P.edit.row = NULL;
+  storeFree(row -> render, row -> rendercap);
+  if (!row -> mapped) storeFree(row -> chars, row -> charscap);
+  else P.store.borrowed--;
+  storeFree(row -> hl, row -> hlcap);
+}
+
+/*** document ***/
+
+// Rows are kept in an implicit treap ordered by line position, so inserting,
+// deleting and looking up a line are all O(log n) and never move other rows.
+// Lines that were never touched since the file was opened are not loaded at
+// all: they stay grouped in run nodes that only point into the file mapping,
+// and are turned into real rows the first time something asks for them.
+
+int nodeCount(rowNode *n) {
+  return n ? n -> count : 0;
+}
+
+int nodeDirty(rowNode *n) {
+  return n ? n -> ndirty : 0;
+}
+
+void nodeUpdate(rowNode *n) {
+  n -> count = nodeCount(n -> left) + nodeCount(n -> right) + n -> lines;
+  n -> ndirty = nodeDirty(n -> left) + nodeDirty(n -> right) + n -> dirty;
+  if (n -> left) n -> left -> parent = n;
+  if (n -> right) n -> right -> parent = n;
+}
+
+unsigned int nodePriority() {
+  static unsigned int seed = 2463534242u;
+  seed ^= seed << 13;
+  seed ^= seed >> 17;
+  seed ^= seed << 5;
+  return seed;
+}
+
+rowNode *nodeNew(int fileline, int lines) {
+  rowNode *n = storeNode();
+  n -> prio = nodePriority();
+  n -> lines = lines;
+  n -> count = lines;
+  n -> fileline = fileline;
+  return n;
+}
+
+rowNode *docMerge(rowNode *a, rowNode *b) {
+  if (!a) return b;
+  if (!b) return a;
+  if (a -> prio > b -> prio) {
+    a -> right = docMerge(a -> right, b);
+    nodeUpdate(a);
+    return a;
+  }
+  b -> left = docMerge(a, b -> left);
+  nodeUpdate(b);
+  return b;
+}
+
+// Splits `t` so that the first `k` rows end up in `*l` and the rest in `*r`.
+// A run straddling the split point is cut in two.
+void docSplit(rowNode *t, int k, rowNode **l, rowNode **r) {
+  if (!t) {
+    *l = *r = NULL;
+    return;
+  }
+  int lc = nodeCount(t -> left);
+  if (k <= lc) {
+    docSplit(t -> left, k, l, &t -> left);
+    nodeUpdate(t);
+    *r = t;
+  } else if (k >= lc + t -> lines) {
+    docSplit(t -> right, k - lc - t -> lines, &t -> right, r);
+    nodeUpdate(t);
+    *l = t;
+  } else {
+    // The tail draws a priority of its own, or a file read from top to
+    // bottom would leave a chain of equal priorities as deep as the number
+    // of rows loaded.
+    rowNode *tail = nodeNew(t -> fileline + (k - lc), t -> lines - (k - lc));
+    tail -> dirty = t -> dirty;
+    nodeUpdate(tail);
+    if (t -> right) t -> right -> parent = NULL;
+    *r = docMerge(tail, t -> right);
+    t -> right = NULL;
+    t -> lines = k - lc;
+    nodeUpdate(t);
+    *l = t;
+  }
+  if (*l) (*l) -> parent = NULL;
+  if (*r) (*r) -> parent = NULL;
+}
+
+void docSetRoot(rowNode *root) {
+  P.rows = root;
+  if (root) root -> parent = NULL;
+  P.numrows = nodeCount(root);
+}
+
+void docFree(rowNode *n) {
+  if (!n) return;
+  docFree(n -> left);
+  docFree(n -> right);
+  if (n -> fileline < 0) editorFreeRow(&n -> row);
+  storeFreeNode(n);
+}
+
+rowNode *nodeFirst(rowNode *n) {
+  if (n) while (n -> left) n = n -> left;
+  return n;
+}
+
+rowNode *nodeNext(rowNode *n) {
+  if (n -> right) return nodeFirst(n -> right);
+  while (n -> parent && n == n -> parent -> right) n = n -> parent;
+  return n -> parent;
+}
+
+rowNode *nodePrev(rowNode *n) {
+  if (n -> left) {
+    n = n -> left;
+    while (n -> right) n = n -> right;
+    return n;
+  }
+  while (n -> parent && n == n -> parent -> left) n = n -> parent;
+  return n -> parent;
+}
+
+// Line starts are kept as the low 32 bits of their offset, which halves the
+// line table. The upper bits only change every 4 GB of file, at the few lines
+// recorded in P.linewrap.
+size_t editorLineOffset(int line) {
+  size_t off = P.lineoff[line];
+  if (P.nlinewrap == 0 || line < P.linewrap[0].line) return off;
+  int lo = 0, hi = P.nlinewrap;
+  while (hi - lo > 1) {
+    int mid = lo + (hi - lo) / 2;
+    if (P.linewrap[mid].line <= line) lo = mid;
+    else hi = mid;
+  }
+  return ((unsigned long long) P.linewrap[lo].high << 32) | off;
+}
+
+void editorSetLineOffset(int line, size_t off) {
+  unsigned int high = (unsigned long long) off >> 32;
+  if (high != (P.nlinewrap ? P.linewrap[P.nlinewrap - 1].high : 0)) {
+    P.linewrap = (lineWrap*) realloc(P.linewrap, sizeof(lineWrap) * (P.nlinewrap + 1));
+    P.linewrap[P.nlinewrap].line = line;
+    P.linewrap[P.nlinewrap].high = high;
+    P.nlinewrap++;
+  }
+  P.lineoff[line] = (unsigned int) off;
+}
+
+// The line of the mapped file that starts at offset `off`.
+int editorMapLine(size_t off) {
+  int lo = 0, hi = P.maplines;
+  while (hi - lo > 1) {
+    int mid = lo + (hi - lo) / 2;
+    if (editorLineOffset(mid) <= off) lo = mid;
+    else hi = mid;
+  }
+  return lo;
+}
+
+// Returns line `line` of the mapped file without its line terminator.
+char *editorFileLine(int line, int *len) {
+  size_t start = editorLineOffset(line);
+  size_t end = editorLineOffset(line + 1);
+  while (end > start && (P.map[end - 1] == '\n' || P.map[end - 1] == '\r'))
+    end--;
+  *len = end - start;
+  return &P.map[start];
+}
+
+// Returns line `k` of node `n`, whether it is a loaded row or part of a run.
+char *editorNodeLine(rowNode *n, int k, int *len) {
+  if (n -> fileline < 0) {
+    *len = n -> row.size;
+    return n -> row.chars;
+  }
+  return editorFileLine(n -> fileline + k, len);
+}
+
+erow *editorRowAt(int at) {
+  if (at < 0 || at >= P.numrows) return NULL;
+  rowNode *n = P.rows;
+  int k = at;
+  while (n) {
+    int lc = nodeCount(n -> left);
+    if (k < lc) {
+      n = n -> left;
+    } else if (k < lc + n -> lines) {
+      break;
+    } else {
+      k -= lc + n -> lines;
+      n = n -> right;
+    }
+  }
+  if (n -> fileline < 0) return &n -> row;
+
+  // Load the row out of its run: cut the run around it and turn the
+  // single-line piece in the middle into a row that borrows the mapping.
+  rowNode *l, *m, *r;
+  docSplit(P.rows, at, &l, &m);
+  docSplit(m, 1, &m, &r);
+  erow *row = &m -> row;
+  row -> chars = editorFileLine(m -> fileline, &row -> size);
+  row -> mapped = 1;
+  P.store.borrowed++;
+  m -> dirty = 1;
+  m -> fileline = -1;
+  nodeUpdate(m);
+  docSetRoot(docMerge(docMerge(l, m), r));
+  return row;
+}
+
+int editorRowIndex(erow *row) {
+  rowNode *n = ROW_NODE(row);
+  int at = nodeCount(n -> left);
+  while (n -> parent) {
+    if (n == n -> parent -> right)
+      at += nodeCount(n -> parent -> left) + n -> parent -> lines;
+    n = n -> parent;
+  }
+  return at;
+}
+
+erow *editorRowNext(erow *row) {
+  rowNode *n = nodeNext(ROW_NODE(row));
+  if (n == NULL) return NULL;
+  if (n -> fileline < 0) return &n -> row;
+  return editorRowAt(editorRowIndex(row) + 1);
+}
+
+erow *editorRowPrev(erow *row) {
+  rowNode *n = nodePrev(ROW_NODE(row));
+  if (n == NULL) return NULL;
+  if (n -> fileline < 0) return &n -> row;
+  return editorRowAt(editorRowIndex(row) - 1);
+}
+
+// Turns the row at `at`, which borrows the mapping, back into a run, folded
+// into the clean runs next to it when they carry on in the file.
+void editorRowRelease(int at) {
+  rowNode *l, *m, *r, *p;
+  docSplit(P.rows, at, &l, &m);
+  docSplit(m, 1, &m, &r);
+  erow *row = &m -> row;
+  int fl = editorMapLine(row -> chars - P.map);
+  if (P.linestate) P.linestate[fl] = m -> dirty ? 0 : row -> hl_in;
+  editorFreeRow(row);
+  memset(row, 0, sizeof(erow));
+  m -> fileline = fl;
+  if (!m -> dirty) {
+    for (p = l; p && p -> right; p = p -> right);
+    if (p && p -> fileline >= 0 && p -> fileline + p -> lines == fl && !p -> dirty) {
+      docSplit(l, nodeCount(l) - p -> lines, &l, &p);
+      p -> lines++;
+      storeFreeNode(m);
+      m = p;
+    }
+    p = nodeFirst(r);
+    if (p && p -> fileline == m -> fileline + m -> lines && !p -> dirty) {
+      docSplit(r, p -> lines, &p, &r);
+      m -> lines += p -> lines;
+      storeFreeNode(p);
+    }
+  }
+  nodeUpdate(m);
+  docSetRoot(docMerge(docMerge(l, m), r));
+}
+
+void nodeSetDirty(rowNode *n, int dirty) {
+  if (n -> dirty == dirty) return;
+  n -> dirty = dirty;
+  for (; n; n = n -> parent)
+    n -> ndirty += dirty ? 1 : -1;
+}
+
+void editorRowSetDirty(erow *row, int dirty) {
+  nodeSetDirty(ROW_NODE(row), dirty);
+}
+
+// Returns the first dirty node, and its position in `*at`.
+rowNode *docFirstDirty(int *at) {
+  rowNode *n = P.rows;
+  int base = 0;
+  if (nodeDirty(n) == 0) return NULL;
+  while (n) {
+    if (nodeDirty(n -> left)) {
+      n = n -> left;
+      continue;
+    }
+    base += nodeCount(n -> left);
+    if (n -> dirty) {
+      *at = base;
+      return n;
+    }
+    base += n -> lines;
+    n = n -> right;
+  }
+  return NULL;
+}
+
+void docMarkDirty(rowNode *n) {
+  if (!n) return;
+  docMarkDirty(n -> left);
+  docMarkDirty(n -> right);
+  n -> dirty = 1;
+  nodeUpdate(n);
+}
+
+// Gives a row borrowing the file mapping its own copy before it is modified.
+void editorRowOwnChars(erow *row) {
+  if (!row -> mapped) return;
+  char *chars = storeAlloc(row -> size + 1, &row -> charscap);
+  memcpy(chars, row -> chars, row -> size);
+  chars[row -> size] = '\0';
+  row -> chars = chars;
+  row -> mapped = 0;
+  P.store.borrowed--;
+}
+
+// With a syntax selected, every line of the mapped file gets a byte recording
+// the lexer state it starts in: 0 if it has not been lexed yet, otherwise 1 +
+// whether it starts inside a multi-line comment.
+void editorLineStateReserve() {
+  if (P.syntax == NULL || P.linestatecap > P.maplines) return;
+  int cap = P.linestatecap ? P.linestatecap : 1024;
+  while (cap <= P.maplines) cap *= 2;
+  P.linestate = (unsigned char*) realloc(P.linestate, cap);
+  memset(&P.linestate[P.linestatecap], 0, cap - P.linestatecap);
+  P.linestatecap = cap;
+}
+
+/*** indexer ***/
+
+// Line starts of a newly opened file are found by worker threads, each
+// scanning fixed-size chunks with SIMD. The main thread folds finished chunks
+// into P.lineoff strictly in file order and appends their lines to the
+// document as runs, so the first screen can be drawn as soon as the first
+// chunk is done.
+
+typedef struct indexChunk {
+  size_t start, end;
+  unsigned int *starts;
+  int nstarts, cap;
+  int done;
+} indexChunk;
+
+struct lineIndexer {
+  char *text;
+  size_t len;
+  indexChunk *chunks;
+  int nchunks;
+  int next;
+  int merged;
+  int nstarts, cap;
+  int filerow;
+  pthread_t threads[PICKLE_INDEX_THREADS];
+  int nthreads;
+};
+
+void indexPush(indexChunk *c, size_t off) {
+  if (c -> nstarts == c -> cap) {
+    c -> cap = c -> cap ? c -> cap * 2 : 4096;
+    c -> starts = (unsigned int*) realloc(c -> starts, sizeof(unsigned int) * c -> cap);
+  }
+  c -> starts[c -> nstarts++] = off - c -> start;
+}
+
+void indexScanScalar(const char *text, indexChunk *c, size_t from) {
+  for (size_t i = from; i < c -> end; i++)
+    if (text[i] == '\n') indexPush(c, i + 1);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+void indexScanSSE2(const char *text, indexChunk *c) {
+  __m128i nl = _mm_set1_epi8('\n');
+  size_t i = c -> start;
+  for (; i + 16 <= c -> end; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*) &text[i]);
+    unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+    while (mask) {
+      indexPush(c, i + __builtin_ctz(mask) + 1);
+      mask &= mask - 1;
+    }
+  }
+  indexScanScalar(text, c, i);
+}
+
+__attribute__((target("avx2")))
+void indexScanAVX2(const char *text, indexChunk *c) {
+  __m256i nl = _mm256_set1_epi8('\n');
+  size_t i = c -> start;
+  for (; i + 32 <= c -> end; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i*) &text[i]);
+    unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+    while (mask) {
+      indexPush(c, i + __builtin_ctz(mask) + 1);
+      mask &= mask - 1;
+    }
+  }
+  indexScanScalar(text, c, i);
+}
+#endif
+
+void indexScanChunk(const char *text, indexChunk *c) {
+#if defined(__x86_64__) || defined(__i386__)
+  static int avx2 = -1;
+  if (avx2 == -1) avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+  if (avx2) {
+    indexScanAVX2(text, c);
+  } else if (__builtin_cpu_supports("sse2")) {
+    indexScanSSE2(text, c);
+  } else {
+    indexScanScalar(text, c, c -> start);
+  }
+#else
+  indexScanScalar(text, c, c -> start);
+#endif
+  __atomic_store_n(&c -> done, 1, __ATOMIC_RELEASE);
+}
+
+void *indexWorker(void *arg) {
+  struct lineIndexer *ix = (struct lineIndexer*) arg;
+  int c;
+  while ((c = __sync_fetch_and_add(&ix -> next, 1)) < ix -> nchunks)
+    indexScanChunk(ix -> text, &ix -> chunks[c]);
+  return NULL;
+}
+
+void indexAppendStart(struct lineIndexer *ix, size_t off) {
+  if (ix -> nstarts + 1 >= ix -> cap) {
+    ix -> cap *= 2;
+    P.lineoff = (unsigned int*) realloc(P.lineoff, sizeof(unsigned int) * ix -> cap);
+  }
+  editorSetLineOffset(ix -> nstarts++, off);
+}
+
+// Folds every finished chunk that is next in file order into the document.
+// Returns 1 if rows were added.
+int editorIndexPoll() {
+  struct lineIndexer *ix = P.indexer;
+  if (ix == NULL) return 0;
+
+  while (ix -> merged < ix -> nchunks &&
+         __atomic_load_n(&ix -> chunks[ix -> merged].done, __ATOMIC_ACQUIRE)) {
+    indexChunk *c = &ix -> chunks[ix -> merged++];
+    for (int i = 0; i < c -> nstarts; i++)
+      if (c -> start + c -> starts[i] < ix -> len) indexAppendStart(ix, c -> start + c -> starts[i]);
+    free(c -> starts);
+    c -> starts = NULL;
+  }
+
+  // The last start found so far only becomes a whole line once the next
+  // start, or the end of the file, is known.
+  int finished = (ix -> merged == ix -> nchunks);
+  int lines = finished ? ix -> nstarts : ix -> nstarts - 1;
+  if (finished) editorSetLineOffset(ix -> nstarts, ix -> len);
+
+  int added = lines - P.maplines;
+  if (added > 0) {
+    rowNode *run = nodeNew(P.maplines, added);
+    run -> dirty = (P.syntax != NULL);
+    nodeUpdate(run);
+    rowNode *l, *r;
+    docSplit(P.rows, ix -> filerow, &l, &r);
+    docSetRoot(docMerge(docMerge(l, run), r));
+    ix -> filerow += added;
+    P.maplines = lines;
+    editorLineStateReserve();
+  }
+
+  if (finished) {
+    for (int i = 0; i < ix -> nthreads; i++) pthread_join(ix -> threads[i], NULL);
+    free(ix -> chunks);
+    free(ix);
+    P.indexer = NULL;
+    if (P.syntax) editorHighlightStart();
+  }
+  return added > 0;
+}
+
+// Blocks until the whole file is indexed.
+void editorIndexWait() {
+  struct lineIndexer *ix = P.indexer;
+  if (ix == NULL) return;
+  for (int i = 0; i < ix -> nthreads; i++) pthread_join(ix -> threads[i], NULL);
+  ix -> nthreads = 0;
+  editorIndexPoll();
+}
+
+void editorIndexStart(char *text, size_t len) {
+  struct lineIndexer *ix = (struct lineIndexer*) calloc(1, sizeof(struct lineIndexer));
+  ix -> text = text;
+  ix -> len = len;
+  ix -> nchunks = (len + PICKLE_INDEX_CHUNK - 1) / PICKLE_INDEX_CHUNK;
+  ix -> chunks = (indexChunk*) calloc(ix -> nchunks + 1, sizeof(indexChunk));
+  for (int i = 0; i < ix -> nchunks; i++) {
+    ix -> chunks[i].start = (size_t) i * PICKLE_INDEX_CHUNK;
+    ix -> chunks[i].end = ix -> chunks[i].start + PICKLE_INDEX_CHUNK;
+    if (ix -> chunks[i].end > len) ix -> chunks[i].end = len;
+  }
+  ix -> cap = 1024;
+  P.lineoff = (unsigned int*) malloc(sizeof(unsigned int) * ix -> cap);
+  if (len) indexAppendStart(ix, 0);
+  P.indexer = ix;
+
+  // The first chunk is scanned right here so there is something to draw;
+  // the rest is left to the workers.
+  ix -> next = 1;
+  if (ix -> nchunks > 1) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int nthreads = ncpu > 0 ? ncpu : 1;
+    if (nthreads > PICKLE_INDEX_THREADS) nthreads = PICKLE_INDEX_THREADS;
+    if (nthreads > ix -> nchunks - 1) nthreads = ix -> nchunks - 1;
+    for (int i = 0; i < nthreads; i++)
+      if (pthread_create(&ix -> threads[ix -> nthreads], NULL, indexWorker, ix) == 0)
+        ix -> nthreads++;
+  }
+  if (ix -> nchunks) indexScanChunk(text, &ix -> chunks[0]);
+  if (ix -> nthreads == 0) {
+    for (int i = 1; i < ix -> nchunks; i++) indexScanChunk(text, &ix -> chunks[i]);
+  }
+  editorIndexPoll();
+}
+
+// Replaces the document with the lines of `text`, which are indexed in the
+// background and come in as runs. `heap` says whether `text` was malloc'd
+// rather than mmap'd.
+void editorLoadText(char *text, size_t len, int heap) {
+  editorIndexWait();
+  editorSaveWait();
+  // A search looks at the old text, so it is stopped and started over on
+  // the new one.
+  char *query = editorSearchTake();
+  editorTrigramStop();
+  editorHighlightStop();
+  docFree(P.rows);
+  docSetRoot(NULL);
+  if (P.map) {
+    if (P.mapheap) free(P.map);
+    else munmap(P.map, P.mapsize);
+  }
+  free(P.lineoff);
+  free(P.linewrap);
+  P.linewrap = NULL;
+  P.nlinewrap = 0;
+  free(P.linestate);
+  P.linestate = NULL;
+  P.linestatecap = 0;
+
+  P.map = text;
+  P.mapsize = len;
+  P.mapheap = heap;
+  P.maplines = 0;
+  editorIndexStart(text, len);
+  if (query) {
+    editorSearchStart(query);
+    free(query);
+  }
+}
+
+/*** regex ***/
+
+// Regex search compiles the pattern to a Thompson NFA over bytes and runs it
+// as a lazy DFA: a DFA state is a set of NFA states, built the first time a
+// scan reaches it and cached with its transitions, so matching is linear in
+// the text and never backtracks. The cache is simply dropped when it fills.
+//
+// Supported: literals, '.', [classes] with ranges and '^', \d \w \s and their
+// upper-case negations, escaped bytes, ^ and $ at line ends, * + ? {n} {n,}
+// {n,m}, | and ( ). Matches never cross a line end.
+
+#define RX_MAX_NODES 20000
+#define RX_MAX_REPEAT 1000
+#define RX_MAX_STATES 2048
+#define RX_MAX_LITERALS 8
+
+enum rxOp {
+  RX_SET,
+  RX_SPLIT,
+  RX_BOL,
+  RX_EOL,
+  RX_MATCH
+};
+
+enum rxAstType {
+  RXA_SET,
+  RXA_BOL,
+  RXA_EOL,
+  RXA_EMPTY,
+  RXA_CAT,
+  RXA_ALT,
+  RXA_REP
+};
+
+typedef struct rxNode {
+  int op;
+  int out, out1;
+  unsigned char set[32];
+} rxNode;
+
+typedef struct rxAst {
+  int type;
+  int min, max;
+  unsigned char set[32];
+  struct rxAst *a, *b;
+} rxAst;
+
+typedef struct rxParser {
+  const char *p;
+  const char *err;
+  rxAst **all;
+  int nall, cap;
+} rxParser;
+
+typedef struct rxDState {
+  int *set;
+  int n;
+  int accept;
+  int acceptEnd;
+  int next[256];
+} rxDState;
+
+typedef struct rxDfa {
+  int start;
+  int unanchored;
+  rxDState *states;
+  int nstates, cap;
+  int hash[RX_MAX_STATES * 2];
+  int begin[2];
+  int flushes;
+} rxDfa;
+
+typedef struct rxProgram {
+  rxNode *nodes;
+  int nnodes, cap;
+  rxDfa fwd, rev;
+  char lit[RX_MAX_LITERALS][64];
+  int litlen[RX_MAX_LITERALS];
+  int nlits;
+  int *stack, *seeds, *buf;
+  unsigned int *mark;
+  unsigned int gen;
+} rxProgram;
+
+void rxSetAdd(unsigned char *set, int c) {
+  set[c >> 3] |= 1 << (c & 7);
+}
+
+int rxSetHas(const unsigned char *set, int c) {
+  return set[c >> 3] & (1 << (c & 7));
+}
+
+// Inverts a class; a line end is never part of one.
+void rxSetInvert(unsigned char *set) {
+  for (int i = 0; i < 32; i++) set[i] = ~set[i];
+  set['\n' >> 3] &= ~(1 << ('\n' & 7));
+}
+
+rxAst *rxNew(rxParser *ps, int type) {
+  if (ps -> nall == ps -> cap) {
+    ps -> cap = ps -> cap ? ps -> cap * 2 : 64;
+    ps -> all = (rxAst**) realloc(ps -> all, sizeof(rxAst*) * ps -> cap);
+  }
+  rxAst *a = (rxAst*) calloc(1, sizeof(rxAst));
+  a -> type = type;
+  ps -> all[ps -> nall++] = a;
+  return a;
+}
+
+rxAst *rxPair(rxParser *ps, int type, rxAst *a, rxAst *b) {
+  rxAst *n = rxNew(ps, type);
+  n -> a = a;
+  n -> b = b;
+  return n;
+}
+
+// Reads the escape after a '\' into `set`.
+void rxParseEscape(rxParser *ps, unsigned char *set) {
+  int c = (unsigned char) *ps -> p;
+  if (c == '\0') {
+    ps -> err = "trailing \\";
+    return;
+  }
+  ps -> p++;
+  switch (tolower(c)) {
+    case 'd':
+      for (int i = '0'; i <= '9'; i++) rxSetAdd(set, i);
+      break;
+    case 'w':
+      for (int i = 0; i < 256; i++)
+        if (isalnum(i) || i == '_') rxSetAdd(set, i);
+      break;
+    case 's':
+      for (const char *s = " \t\r\f\v"; *s; s++) rxSetAdd(set, *s);
+      break;
+    case 't':
+      rxSetAdd(set, c == 't' ? '\t' : c);
+      return;
+    default:
+      rxSetAdd(set, c);
+      return;
+  }
+  if (isupper(c)) rxSetInvert(set);
+}
+
+rxAst *rxParseClass(rxParser *ps) {
+  rxAst *a = rxNew(ps, RXA_SET);
+  int negate = 0;
+  if (*ps -> p == '^') {
+    negate = 1;
+    ps -> p++;
+  }
+  int first = 1;
+  while (*ps -> p && (*ps -> p != ']' || first)) {
+    first = 0;
+    int lo = (unsigned char) *ps -> p++;
+    if (lo == '\\') {
+      unsigned char esc[32] = {0};
+      rxParseEscape(ps, esc);
+      for (int i = 0; i < 32; i++) a -> set[i] |= esc[i];
+      continue;
+    }
+    int hi = lo;
+    if (ps -> p[0] == '-' && ps -> p[1] && ps -> p[1] != ']') {
+      hi = (unsigned char) ps -> p[1];
+      ps -> p += 2;
+    }
+    if (hi < lo) {
+      ps -> err = "bad range";
+      return a;
+    }
+    for (int i = lo; i <= hi; i++) rxSetAdd(a -> set, i);
+  }
+  if (*ps -> p != ']') {
+    ps -> err = "missing ]";
+    return a;
+  }
+  ps -> p++;
+  if (negate) rxSetInvert(a -> set);
+  return a;
+}
+
+rxAst *rxParseAlt(rxParser *ps);
+
+rxAst *rxParseAtom(rxParser *ps) {
+  int c = (unsigned char) *ps -> p++;
+  rxAst *a;
+  switch (c) {
+    case '(':
+      a = rxParseAlt(ps);
+      if (*ps -> p != ')') {
+        ps -> err = "missing )";
+        return a;
+      }
+      ps -> p++;
+      return a;
+    case '[':
+      return rxParseClass(ps);
+    case '.':
+      a = rxNew(ps, RXA_SET);
+      rxSetInvert(a -> set);
+      return a;
+    case '^':
+      return rxNew(ps, RXA_BOL);
+    case '$':
+      return rxNew(ps, RXA_EOL);
+    case '*':
+    case '+':
+    case '?':
+      ps -> err = "nothing to repeat";
+      return rxNew(ps, RXA_EMPTY);
+    case '\\':
+      a = rxNew(ps, RXA_SET);
+      rxParseEscape(ps, a -> set);
+      return a;
+    default:
+      a = rxNew(ps, RXA_SET);
+      rxSetAdd(a -> set, c);
+      return a;
+  }
+}
+
+int rxParseCount(rxParser *ps) {
+  if (!isdigit((unsigned char) *ps -> p)) return -1;
+  int n = 0;
+  while (isdigit((unsigned char) *ps -> p)) {
+    n = n * 10 + (*ps -> p++ - '0');
+    if (n > RX_MAX_REPEAT) {
+      ps -> err = "repeat count too big";
+      return -1;
+    }
+  }
+  return n;
+}
+
+rxAst *rxParseRepeat(rxParser *ps) {
+  rxAst *a = rxParseAtom(ps);
+  while (!ps -> err) {
+    int min, max;
+    char c = *ps -> p;
+    if (c == '*') {
+      min = 0;
+      max = -1;
+    } else if (c == '+') {
+      min = 1;
+      max = -1;
+    } else if (c == '?') {
+      min = 0;
+      max = 1;
+    } else if (c == '{') {
+      ps -> p++;
+      min = rxParseCount(ps);
+      max = min;
+      if (*ps -> p == ',') {
+        ps -> p++;
+        max = (*ps -> p == '}') ? -1 : rxParseCount(ps);
+      }
+      if (ps -> err) break;
+      if (min < 0 || *ps -> p != '}' || (max >= 0 && max < min)) {
+        ps -> err = "bad {}";
+        break;
+      }
+    } else {
+      break;
+    }
+    ps -> p++;
+    rxAst *r = rxNew(ps, RXA_REP);
+    r -> a = a;
+    r -> min = min;
+    r -> max = max;
+    a = r;
+  }
+  return a;
+}
+
+rxAst *rxParseCat(rxParser *ps) {
+  rxAst *a = rxNew(ps, RXA_EMPTY);
+  while (*ps -> p && *ps -> p != '|' && *ps -> p != ')' && !ps -> err)
+    a = rxPair(ps, RXA_CAT, a, rxParseRepeat(ps));
+  return a;
+}
+
+rxAst *rxParseAlt(rxParser *ps) {
+  rxAst *a = rxParseCat(ps);
+  while (*ps -> p == '|' && !ps -> err) {
+    ps -> p++;
+    a = rxPair(ps, RXA_ALT, a, rxParseCat(ps));
+  }
+  return a;
+}
+
+int rxAddNode(rxProgram *rx, int op, int out) {
+  if (rx -> nnodes == rx -> cap) {
+    rx -> cap = rx -> cap ? rx -> cap * 2 : 64;
+    rx -> nodes = (rxNode*) realloc(rx -> nodes, sizeof(rxNode) * rx -> cap);
+  }
+  rxNode *n = &rx -> nodes[rx -> nnodes];
+  memset(n, 0, sizeof(rxNode));
+  n -> op = op;
+  n -> out = out;
+  n -> out1 = -1;
+  return rx -> nnodes++;
+}
+
+// Builds the NFA for `a` so that it continues into node `next`, and returns
+// its entry node, or -1 if the NFA grows too big. With `reverse` set the
+// NFA matches the reversed text.
+int rxCompile(rxProgram *rx, rxAst *a, int next, int reverse) {
+  if (rx -> nnodes > RX_MAX_NODES) return -1;
+  int n;
+  switch (a -> type) {
+    case RXA_SET:
+      n = rxAddNode(rx, RX_SET, next);
+      memcpy(rx -> nodes[n].set, a -> set, 32);
+      return n;
+    case RXA_BOL:
+      return rxAddNode(rx, reverse ? RX_EOL : RX_BOL, next);
+    case RXA_EOL:
+      return rxAddNode(rx, reverse ? RX_BOL : RX_EOL, next);
+    case RXA_EMPTY:
+      return next;
+    case RXA_CAT:
+      if (reverse) {
+        next = rxCompile(rx, a -> a, next, reverse);
+        return next < 0 ? -1 : rxCompile(rx, a -> b, next, reverse);
+      }
+      next = rxCompile(rx, a -> b, next, reverse);
+      return next < 0 ? -1 : rxCompile(rx, a -> a, next, reverse);
+    case RXA_ALT: {
+      int l = rxCompile(rx, a -> a, next, reverse);
+      int r = rxCompile(rx, a -> b, next, reverse);
+      if (l < 0 || r < 0) return -1;
+      n = rxAddNode(rx, RX_SPLIT, l);
+      rx -> nodes[n].out1 = r;
+      return n;
+    }
+    case RXA_REP: {
+      // x{min,max} is min copies of x followed by max - min optional ones,
+      // or by a loop when there is no max.
+      int s = next;
+      if (a -> max < 0) {
+        n = rxAddNode(rx, RX_SPLIT, -1);
+        rx -> nodes[n].out1 = next;
+        int body = rxCompile(rx, a -> a, n, reverse);
+        if (body < 0) return -1;
+        rx -> nodes[n].out = body;
+        s = n;
+      } else {
+        for (int i = a -> min; i < a -> max; i++) {
+          int body = rxCompile(rx, a -> a, s, reverse);
+          if (body < 0) return -1;
+          n = rxAddNode(rx, RX_SPLIT, body);
+          rx -> nodes[n].out1 = next;
+          s = n;
+        }
+      }
+      for (int i = 0; i < a -> min && s >= 0; i++) s = rxCompile(rx, a -> a, s, reverse);
+      return s;
+    }
+  }
+  return -1;
+}
+
+// Collects the single bytes of a top-level concatenation, in order, with -1
+// marking anything that is not one fixed byte.
+void rxFlatten(rxAst *a, int *seq, int *n, int max) {
+  if (a -> type == RXA_CAT) {
+    rxFlatten(a -> a, seq, n, max);
+    rxFlatten(a -> b, seq, n, max);
+    return;
+  }
+  if (a -> type == RXA_EMPTY || *n == max) return;
+  int byte = -1;
+  if (a -> type == RXA_SET) {
+    for (int c = 0; c < 256; c++) {
+      if (!rxSetHas(a -> set, c)) continue;
+      if (byte != -1) {
+        byte = -1;
+        break;
+      }
+      byte = c;
+    }
+  }
+  seq[(*n)++] = byte;
+}
+
+// The runs of fixed bytes every match must contain. A line without one of
+// them cannot match, so the search can skip to lines that have it.
+void rxFindLiterals(rxProgram *rx, rxAst *a) {
+  int seq[256];
+  int n = 0;
+  rxFlatten(a, seq, &n, 256);
+  rx -> nlits = 0;
+  for (int i = 0; i < n && rx -> nlits < RX_MAX_LITERALS; ) {
+    int j = i;
+    while (j < n && seq[j] >= 0) j++;
+    if (j > i) {
+      int len = j - i < (int) sizeof(rx -> lit[0]) ? j - i : (int) sizeof(rx -> lit[0]);
+      for (int k = 0; k < len; k++) rx -> lit[rx -> nlits][k] = seq[i + k];
+      rx -> litlen[rx -> nlits++] = len;
+    }
+    i = j + 1;
+  }
+}
+
+void rxDfaInit(rxDfa *d, int start, int unanchored) {
+  d -> start = start;
+  d -> unanchored = unanchored;
+  d -> states = NULL;
+  d -> nstates = d -> cap = 0;
+  memset(d -> hash, 0, sizeof(d -> hash));
+  d -> begin[0] = d -> begin[1] = -1;
+  d -> flushes = 0;
+}
+
+void rxDfaFlush(rxDfa *d) {
+  for (int i = 0; i < d -> nstates; i++) free(d -> states[i].set);
+  d -> nstates = 0;
+  memset(d -> hash, 0, sizeof(d -> hash));
+  d -> begin[0] = d -> begin[1] = -1;
+  d -> flushes++;
+}
+
+void rxFree(rxProgram *rx) {
+  if (rx == NULL) return;
+  rxDfaFlush(&rx -> fwd);
+  rxDfaFlush(&rx -> rev);
+  free(rx -> fwd.states);
+  free(rx -> rev.states);
+  free(rx -> nodes);
+  free(rx -> stack);
+  free(rx -> seeds);
+  free(rx -> buf);
+  free(rx -> mark);
+  free(rx);
+}
+
+// Compiles `pattern`, or returns NULL and points *err at the reason.
+rxProgram *rxCompilePattern(const char *pattern, const char **err) {
+  rxParser ps = {pattern, NULL, NULL, 0, 0};
+  rxAst *a = rxParseAlt(&ps);
+  if (!ps.err && *ps.p) ps.err = "unmatched )";
+
+  rxProgram *rx = NULL;
+  if (!ps.err) {
+    rx = (rxProgram*) calloc(1, sizeof(rxProgram));
+    int match = rxAddNode(rx, RX_MATCH, -1);
+    int start = rxCompile(rx, a, match, 0);
+    int rstart = start < 0 ? -1 : rxCompile(rx, a, match, 1);
+    if (rstart < 0) {
+      ps.err = "pattern too big";
+      rxFree(rx);
+      rx = NULL;
+    } else {
+      rxDfaInit(&rx -> fwd, start, 0);
+      rxDfaInit(&rx -> rev, rstart, 1);
+      rxFindLiterals(rx, a);
+      rx -> stack = (int*) malloc(sizeof(int) * (3 * rx -> nnodes + 2));
+      rx -> seeds = (int*) malloc(sizeof(int) * (rx -> nnodes + 1));
+      rx -> buf = (int*) malloc(sizeof(int) * (rx -> nnodes + 1));
+      rx -> mark = (unsigned int*) calloc(rx -> nnodes, sizeof(unsigned int));
+    }
+  }
+  for (int i = 0; i < ps.nall; i++) free(ps.all[i]);
+  free(ps.all);
+  *err = ps.err;
+  return rx;
+}
+
+int rxCompareInt(const void *a, const void *b) {
+  return *(const int*) a - *(const int*) b;
+}
+
+// Follows the empty edges out of `seeds` and leaves the sorted set of nodes
+// reached in rx -> buf. Line-end assertions that do not hold yet stay in the
+// set, so they can still be passed at the end of the line.
+int rxClosure(rxProgram *rx, int *seeds, int nseeds, int bol, int eol) {
+  int sp = 0, n = 0;
+  rx -> gen++;
+  for (int i = 0; i < nseeds; i++) rx -> stack[sp++] = seeds[i];
+  while (sp) {
+    int s = rx -> stack[--sp];
+    if (rx -> mark[s] == rx -> gen) continue;
+    rx -> mark[s] = rx -> gen;
+    rxNode *node = &rx -> nodes[s];
+    if (node -> op == RX_SPLIT) {
+      rx -> stack[sp++] = node -> out;
+      rx -> stack[sp++] = node -> out1;
+    } else if ((node -> op == RX_BOL && bol) || (node -> op == RX_EOL && eol)) {
+      rx -> stack[sp++] = node -> out;
+    } else {
+      rx -> buf[n++] = s;
+    }
+  }
+  qsort(rx -> buf, n, sizeof(int), rxCompareInt);
+  return n;
+}
+
+// Returns the DFA state for the NFA set in rx -> buf, adding it if needed.
+int rxState(rxProgram *rx, rxDfa *d, int n) {
+  unsigned int h = 2166136261u;
+  for (int i = 0; i < n; i++) h = (h ^ rx -> buf[i]) * 16777619u;
+  unsigned int mask = RX_MAX_STATES * 2 - 1;
+  unsigned int slot = h & mask;
+  while (d -> hash[slot]) {
+    rxDState *s = &d -> states[d -> hash[slot] - 1];
+    if (s -> n == n && memcmp(s -> set, rx -> buf, sizeof(int) * n) == 0)
+      return d -> hash[slot] - 1;
+    slot = (slot + 1) & mask;
+  }
+
+  if (d -> nstates == RX_MAX_STATES) {
+    rxDfaFlush(d);
+    return rxState(rx, d, n);
+  }
+  if (d -> nstates == d -> cap) {
+    d -> cap = d -> cap ? d -> cap * 2 : 16;
+    d -> states = (rxDState*) realloc(d -> states, sizeof(rxDState) * d -> cap);
+  }
+  rxDState *s = &d -> states[d -> nstates];
+  s -> set = (int*) malloc(sizeof(int) * (n ? n : 1));
+  memcpy(s -> set, rx -> buf, sizeof(int) * n);
+  s -> n = n;
+  s -> accept = 0;
+  for (int i = 0; i < n; i++)
+    if (rx -> nodes[rx -> buf[i]].op == RX_MATCH) s -> accept = 1;
+  s -> acceptEnd = -1;
+  for (int c = 0; c < 256; c++) s -> next[c] = -1;
+  d -> hash[slot] = ++d -> nstates;
+  return d -> nstates - 1;
+}
+
+// State a scan starts in; `edge` says whether it starts at the line end the
+// DFA's own ^ refers to.
+int rxBegin(rxProgram *rx, rxDfa *d, int edge) {
+  if (d -> begin[edge] < 0) {
+    int start = d -> start;
+    int n = rxClosure(rx, &start, 1, edge, 0);
+    d -> begin[edge] = rxState(rx, d, n);
+  }
+  return d -> begin[edge];
+}
+
+int rxStep(rxProgram *rx, rxDfa *d, int st, unsigned char c) {
+  int t = d -> states[st].next[c];
+  if (t >= 0) return t;
+
+  rxDState *s = &d -> states[st];
+  int k = 0;
+  for (int i = 0; i < s -> n; i++) {
+    rxNode *node = &rx -> nodes[s -> set[i]];
+    if (node -> op == RX_SET && rxSetHas(node -> set, c)) rx -> seeds[k++] = node -> out;
+  }
+  if (d -> unanchored) rx -> seeds[k++] = d -> start;
+  int n = rxClosure(rx, rx -> seeds, k, 0, 0);
+
+  int flushes = d -> flushes;
+  t = rxState(rx, d, n);
+  if (flushes == d -> flushes) d -> states[st].next[c] = t;
+  return t;
+}
+
+// Whether state `st` accepts when the text ends here.
+int rxAcceptEnd(rxProgram *rx, rxDfa *d, int st) {
+  rxDState *s = &d -> states[st];
+  if (s -> acceptEnd < 0) {
+    int n = rxClosure(rx, s -> set, s -> n, 0, 1);
+    s -> acceptEnd = 0;
+    for (int i = 0; i < n; i++)
+      if (rx -> nodes[rx -> buf[i]].op == RX_MATCH) s -> acceptEnd = 1;
+  }
+  return s -> acceptEnd;
+}
+
+// Finds the leftmost-longest matches in one line of `len` bytes. A reverse
+// scan over the whole line marks in `starts` every offset a match can begin
+// at; each match is then extended forward from the first such offset past
+// the previous match. Calls `found` for every match and returns how many.
+int rxLineMatches(rxProgram *rx, const char *s, int len, unsigned char *starts,
+                  void (*found)(void *, int, int), void *arg) {
+  int any = 0;
+  rxDfa *d = &rx -> rev;
+  int st = rxBegin(rx, d, 1);
+  for (int i = len; i > 0; i--) {
+    starts[i] = d -> states[st].accept;
+    any |= starts[i];
+    int t = d -> states[st].next[(unsigned char) s[i - 1]];
+    st = t >= 0 ? t : rxStep(rx, d, st, s[i - 1]);
+  }
+  starts[0] = rxAcceptEnd(rx, d, st);
+  any |= starts[0];
+  if (!any) return 0;
+
+  int count = 0;
+  int from = 0;
+  while (from <= len) {
+    int begin = from;
+    while (begin <= len && !starts[begin]) begin++;
+    if (begin > len) break;
+
+    int end = -1;
+    st = rxBegin(rx, &rx -> fwd, begin == 0);
+    for (int i = begin; ; i++) {
+      if (rx -> fwd.states[st].accept || (i == len && rxAcceptEnd(rx, &rx -> fwd, st))) end = i;
+      if (i == len || rx -> fwd.states[st].n == 0) break;
+      st = rxStep(rx, &rx -> fwd, st, s[i]);
+    }
+    if (end < 0) {
+      from = begin + 1;
+      continue;
+    }
+    found(arg, begin, end - begin);
+    count++;
+    from = end > begin ? end : begin + 1;
+  }
+  return count;
+}
+
+/*** trigram index ***/
+
+// A big file can be given a trigram index (Ctrl-T) so that repeated
+// searches only scan the parts of the file that can match. The mapping is cut into fixed blocks,
+// and each block keeps a small Bloom filter of the trigrams starting in it
+// (or in the first bytes of the next block, so a short needle that starts
+// in the block is covered whole). A needle can only occur in blocks whose
+// filter has all of its trigrams.
+//
+// The index describes the file as it is mapped, which never changes while
+// it is open: edited lines become loaded rows and are always searched
+// directly. It is built in the background only when asked for, and saved
+// in the user's cache directory keyed by the file's size and mtime, so
+// reopening the file picks it up again without the work. A saved index
+// that no longer matches its file is deleted when the file is opened.
+
+typedef unsigned long long trigramWord;
+
+typedef struct trigramIndex {
+  const char *text;
+  size_t len;
+  long long mtime, mtimensec;
+  int nblocks;
+  unsigned char *logbits;
+  size_t *offset;
+  trigramWord *words;
+  size_t nwords, cap;
+  char *path;
+  int ready;
+  int cancel;
+  int threaded;
+  pthread_t thread;
+} trigramIndex;
+
+trigramWord trigramHash(unsigned int t) {
+  trigramWord x = t;
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  x ^= x >> 33;
+  return x;
+}
+
+// Three probes per trigram, by double hashing.
+#define TRIGRAM_PROBE(h, i, mask) (((h) + (i) * (((h) >> 32) | 1)) & (mask))
+
+int trigramMayContain(trigramIndex *ix, int block, trigramWord *hashes, int n) {
+  if (block < 0 || block >= ix -> nblocks) return 1;
+  trigramWord *bits = &ix -> words[ix -> offset[block]];
+  trigramWord mask = ((trigramWord) 1 << ix -> logbits[block]) - 1;
+  for (int k = 0; k < n; k++)
+    for (int i = 0; i < 3; i++) {
+      trigramWord b = TRIGRAM_PROBE(hashes[k], i, mask);
+      if (!(bits[b >> 6] & ((trigramWord) 1 << (b & 63)))) return 0;
+    }
+  return 1;
+}
+
+// The index for `filename` is $XDG_CACHE_HOME/pickle/<hash>.index (or
+// under ~/.cache), named by a hash of the file's real path. Returns NULL
+// when there is nowhere to keep it. With `create` the directories are made.
+char *trigramPath(const char *filename, int create) {
+  char dir[PATH_MAX];
+  const char *cache = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  if (cache && cache[0] == '/') snprintf(dir, sizeof(dir), "%s", cache);
+  else if (home && home[0]) snprintf(dir, sizeof(dir), "%s/.cache", home);
+  else return NULL;
+  if (create) mkdir(dir, 0700);
+  strncat(dir, "/pickle", sizeof(dir) - strlen(dir) - 1);
+  if (create) mkdir(dir, 0700);
+
+  char full[PATH_MAX];
+  if (realpath(filename, full) == NULL) return NULL;
+  unsigned long long h = 0xcbf29ce484222325ULL;
+  for (const char *c = full; *c; c++) h = (h ^ (unsigned char) *c) * 0x100000001b3ULL;
+  char *path = (char*) malloc(strlen(dir) + 32);
+  sprintf(path, "%s/%016llx.index", dir, h);
+  return path;
+}
+
+// Writes the index to a temporary file and renames it into place, so a
+// crash never leaves a torn index behind. Failures are ignored: the index
+// is only a cache.
+void trigramSave(trigramIndex *ix) {
+  if (ix -> path == NULL) return;
+  char tmp[PATH_MAX];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", ix -> path);
+  FILE *f = fopen(tmp, "wb");
+  if (f == NULL) return;
+  unsigned long long size = ix -> len, nwords = ix -> nwords;
+  int ok = fwrite(PICKLE_TRIGRAM_MAGIC, 8, 1, f) == 1 &&
+    fwrite(&size, sizeof(size), 1, f) == 1 &&
+    fwrite(&ix -> mtime, sizeof(ix -> mtime), 1, f) == 1 &&
+    fwrite(&ix -> mtimensec, sizeof(ix -> mtimensec), 1, f) == 1 &&
+    fwrite(&ix -> nblocks, sizeof(ix -> nblocks), 1, f) == 1 &&
+    fwrite(&nwords, sizeof(nwords), 1, f) == 1 &&
+    fwrite(ix -> logbits, 1, ix -> nblocks, f) == (size_t) ix -> nblocks &&
+    fwrite(ix -> offset, sizeof(size_t), ix -> nblocks, f) == (size_t) ix -> nblocks &&
+    fwrite(ix -> words, sizeof(trigramWord), ix -> nwords, f) == ix -> nwords;
+  if (fclose(f) != 0) ok = 0;
+  if (ok) rename(tmp, ix -> path);
+  else unlink(tmp);
+}
+
+// Loads a saved index if it was built for this very file, and deletes one
+// left for an older version of it or that does not read back whole.
+int trigramLoad(trigramIndex *ix) {
+  if (ix -> path == NULL) return 0;
+  FILE *f = fopen(ix -> path, "rb");
+  if (f == NULL) return 0;
+  char magic[8];
+  unsigned long long size, nwords;
+  long long mtime, mtimensec;
+  int nblocks;
+  int ok = fread(magic, 8, 1, f) == 1 && memcmp(magic, PICKLE_TRIGRAM_MAGIC, 8) == 0 &&
+    fread(&size, sizeof(size), 1, f) == 1 && size == ix -> len &&
+    fread(&mtime, sizeof(mtime), 1, f) == 1 && mtime == ix -> mtime &&
+    fread(&mtimensec, sizeof(mtimensec), 1, f) == 1 && mtimensec == ix -> mtimensec &&
+    fread(&nblocks, sizeof(nblocks), 1, f) == 1 && nblocks == ix -> nblocks &&
+    fread(&nwords, sizeof(nwords), 1, f) == 1 && nwords <= ix -> len;
+  if (ok) {
+    ix -> nwords = ix -> cap = nwords;
+    ix -> words = (trigramWord*) malloc(sizeof(trigramWord) * (nwords ? nwords : 1));
+    ok = fread(ix -> logbits, 1, nblocks, f) == (size_t) nblocks &&
+      fread(ix -> offset, sizeof(size_t), nblocks, f) == (size_t) nblocks &&
+      fread(ix -> words, sizeof(trigramWord), nwords, f) == nwords;
+    // A filter never needs more than 2^40 bits, and must fit in the words
+    // read, which rules out shifting or indexing past them on a bad file.
+    for (int b = 0; ok && b < nblocks; b++)
+      if (ix -> logbits[b] < 6 || ix -> logbits[b] > 40 || ix -> offset[b] > nwords ||
+          ((size_t) 1 << (ix -> logbits[b] - 6)) > nwords - ix -> offset[b]) ok = 0;
+  }
+  fclose(f);
+  if (!ok) unlink(ix -> path);
+  return ok;
+}
+
+void *trigramWorker(void *arg) {
+  trigramIndex *ix = (trigramIndex*) arg;
+  const unsigned char *text = (const unsigned char*) ix -> text;
+  // Trigrams already seen in the current block, as a bit per trigram.
+  trigramWord *seen = (trigramWord*) calloc((1 << 24) / 64, sizeof(trigramWord));
+  unsigned int *found = (unsigned int*) malloc(sizeof(unsigned int) * (PICKLE_TRIGRAM_BLOCK + PICKLE_TRIGRAM_OVERLAP));
+
+  for (int b = 0; b < ix -> nblocks; b++) {
+    if (__atomic_load_n(&ix -> cancel, __ATOMIC_RELAXED)) break;
+    size_t start = (size_t) b * PICKLE_TRIGRAM_BLOCK;
+    // Trigrams starting up to OVERLAP bytes past the block count too, so a
+    // needle beginning in this block finds all the trigrams it checks.
+    size_t end = start + PICKLE_TRIGRAM_BLOCK + PICKLE_TRIGRAM_OVERLAP + 2;
+    if (end > ix -> len) end = ix -> len;
+    int n = 0;
+    for (size_t i = start; i + 3 <= end; i++) {
+      unsigned int t = (text[i] << 16) | (text[i + 1] << 8) | text[i + 2];
+      trigramWord bit = (trigramWord) 1 << (t & 63);
+      if (seen[t >> 6] & bit) continue;
+      seen[t >> 6] |= bit;
+      found[n++] = t;
+    }
+
+    // About ten bits per trigram keeps a three-probe filter near 2% false
+    // positives per trigram, and a needle checks several of them.
+    int logbits = 6;
+    while (((size_t) 1 << logbits) < (size_t) n * 10) logbits++;
+    size_t words = (size_t) 1 << (logbits - 6);
+    if (ix -> nwords + words > ix -> cap) {
+      while (ix -> nwords + words > ix -> cap) ix -> cap = ix -> cap ? ix -> cap * 2 : 4096;
+      ix -> words = (trigramWord*) realloc(ix -> words, sizeof(trigramWord) * ix -> cap);
+    }
+    trigramWord *bits = &ix -> words[ix -> nwords];
+    memset(bits, 0, sizeof(trigramWord) * words);
+    trigramWord mask = ((trigramWord) 1 << logbits) - 1;
+    for (int k = 0; k < n; k++) {
+      trigramWord h = trigramHash(found[k]);
+      for (int i = 0; i < 3; i++) {
+        trigramWord p = TRIGRAM_PROBE(h, i, mask);
+        bits[p >> 6] |= (trigramWord) 1 << (p & 63);
+      }
+      seen[found[k] >> 6] = 0;
+    }
+    ix -> logbits[b] = logbits;
+    ix -> offset[b] = ix -> nwords;
+    ix -> nwords += words;
+  }
+  free(found);
+  free(seen);
+
+  if (!__atomic_load_n(&ix -> cancel, __ATOMIC_RELAXED)) {
+    trigramSave(ix);
+    __atomic_store_n(&ix -> ready, 1, __ATOMIC_RELEASE);
+  }
+  return NULL;
+}
+
+void editorTrigramStop() {
+  trigramIndex *ix = P.trigram;
+  if (ix == NULL) return;
+  __atomic_store_n(&ix -> cancel, 1, __ATOMIC_RELAXED);
+  if (ix -> threaded) pthread_join(ix -> thread, NULL);
+  free(ix -> logbits);
+  free(ix -> offset);
+  free(ix -> words);
+  free(ix -> path);
+  free(ix);
+  P.trigram = NULL;
+}
+
+// Sets up the index for the file just mapped from `filename`, and loads it
+// when one was built for it before. Otherwise it stays empty until asked
+// for with editorTrigramBuild.
+void editorTrigramStart(const char *filename, struct stat *st) {
+  if (P.mapsize < PICKLE_TRIGRAM_MIN) return;
+  trigramIndex *ix = (trigramIndex*) calloc(1, sizeof(trigramIndex));
+  ix -> text = P.map;
+  ix -> len = P.mapsize;
+  ix -> mtime = st -> st_mtim.tv_sec;
+  ix -> mtimensec = st -> st_mtim.tv_nsec;
+  ix -> nblocks = (ix -> len + PICKLE_TRIGRAM_BLOCK - 1) / PICKLE_TRIGRAM_BLOCK;
+  ix -> logbits = (unsigned char*) calloc(ix -> nblocks, 1);
+  ix -> offset = (size_t*) calloc(ix -> nblocks, sizeof(size_t));
+
+  ix -> path = trigramPath(filename, 0);
+  P.trigram = ix;
+
+  if (trigramLoad(ix)) {
+    ix -> ready = 1;
+    return;
+  }
+  free(ix -> words);
+  ix -> words = NULL;
+  ix -> nwords = ix -> cap = 0;
+}
+
+// Starts building the index of the open file in the background.
+void editorTrigramBuild() {
+  trigramIndex *ix = P.trigram;
+  if (ix == NULL) {
+    editorSetStatusMessage("Only files of %d MB or more get a search index", PICKLE_TRIGRAM_MIN >> 20);
+    return;
+  }
+  if (__atomic_load_n(&ix -> ready, __ATOMIC_ACQUIRE)) {
+    editorSetStatusMessage("The file is already indexed");
+    return;
+  }
+  if (ix -> threaded) {
+    editorSetStatusMessage("The search index is still being built");
+    return;
+  }
+  free(ix -> path);
+  ix -> path = trigramPath(P.filename, 1);
+  if (pthread_create(&ix -> thread, NULL, trigramWorker, ix) == 0) {
+    ix -> threaded = 1;
+    editorSetStatusMessage("Building the search index in the background");
+  } else {
+    editorSetStatusMessage("Can't start building the search index");
+  }
+}
+
+/*** search ***/
+
+// A search runs on a worker thread over a snapshot of where the document's
+// text lives: untouched lines are searched straight in the file mapping, run
+// by run, and loaded rows through their own chars. Nothing is copied, so the
+// snapshot is only valid while the document is left alone, which holds for
+// as long as the search prompt is open. Scanning starts at the cursor line
+// and wraps around, so matches come out nearest first and the list stays in
+// that cyclic order.
+//
+// While the query only grows, the matches of the previous query are the
+// only places the new one can match, so a finished search hands them to the
+// next job as candidates and only those get checked again.
+//
+// In regex mode each line is run through the regex engine instead, but when
+// the pattern has a fixed piece of text in it, the literal kernels first
+// jump straight to the lines that contain it.
+
+typedef struct searchSeg {
+  const char *text;
+  size_t len;
+  int line;
+  int fileline;
+  int lines;
+} searchSeg;
+
+typedef struct searchMatch {
+  int line;
+  int col;
+  int len;
+} searchMatch;
+
+struct searchJob {
+  char *query;
+  int qlen;
+  const char *needle;
+  int nlen;
+  int skip[256];
+  rxProgram *rx;
+  const char *error;
+  trigramIndex *tri;
+  trigramWord tris[PICKLE_TRIGRAM_OVERLAP];
+  int ntris;
+  unsigned char *starts;
+  int startscap;
+  searchMatch found[256];
+  int nfound;
+  searchSeg *segs;
+  int nsegs, segcap;
+  int first;
+  pthread_mutex_t lock;
+  searchMatch *matches;
+  int nmatches, cap;
+  searchMatch *cands;
+  int ncands, candfirst;
+  int narrow;
+  int drawn, drawndone;
+  int done;
+  int cancel;
+  int current;
+  erow *marked;
+  searchMatch mark;
+  int threaded;
+  pthread_t thread;
+};
+
+// Horspool: shift by how far the byte under the pattern's last position is
+// from the end of the pattern.
+const char *searchHorspool(struct searchJob *job, const char *s, size_t len) {
+  size_t m = job -> nlen;
+  const char *q = job -> needle;
+  size_t i = 0;
+  while (i + m <= len) {
+    unsigned char last = s[i + m - 1];
+    if (last == (unsigned char) q[m - 1] && memcmp(&s[i], q, m - 1) == 0)
+      return &s[i];
+    i += job -> skip[last];
+  }
+  return NULL;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Candidates are positions where both the first and the last byte of the
+// query match; only those get a full compare.
+__attribute__((target("sse2")))
+const char *searchSSE2(struct searchJob *job, const char *s, size_t len) {
+  size_t m = job -> nlen;
+  const char *q = job -> needle;
+  __m128i first = _mm_set1_epi8(q[0]);
+  __m128i last = _mm_set1_epi8(q[m - 1]);
+  size_t i = 0;
+  for (; i + m - 1 + 16 <= len; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i*) &s[i]);
+    __m128i b = _mm_loadu_si128((const __m128i*) &s[i + m - 1]);
+    unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+    while (mask) {
+      size_t at = i + __builtin_ctz(mask);
+      if (memcmp(&s[at + 1], q + 1, m - 2) == 0) return &s[at];
+      mask &= mask - 1;
+    }
+  }
+  return i < len ? searchHorspool(job, &s[i], len - i) : NULL;
+}
+
+__attribute__((target("avx2")))
+const char *searchAVX2(struct searchJob *job, const char *s, size_t len) {
+  size_t m = job -> nlen;
+  const char *q = job -> needle;
+  __m256i first = _mm256_set1_epi8(q[0]);
+  __m256i last = _mm256_set1_epi8(q[m - 1]);
+  size_t i = 0;
+  for (; i + m - 1 + 32 <= len; i += 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i*) &s[i]);
+    __m256i b = _mm256_loadu_si256((const __m256i*) &s[i + m - 1]);
+    unsigned int mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+    while (mask) {
+      size_t at = i + __builtin_ctz(mask);
+      if (memcmp(&s[at + 1], q + 1, m - 2) == 0) return &s[at];
+      mask &= mask - 1;
+    }
+  }
+  return i < len ? searchHorspool(job, &s[i], len - i) : NULL;
+}
+#endif
+
+// First occurrence of the needle in s[0..len).
+const char *searchFind(struct searchJob *job, const char *s, size_t len) {
+  if (job -> nlen == 1) return (const char*) memchr(s, job -> needle[0], len);
+#if defined(__x86_64__) || defined(__i386__)
+  static int avx2 = -1;
+  if (avx2 == -1) avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+  if (avx2) return searchAVX2(job, s, len);
+  if (__builtin_cpu_supports("sse2")) return searchSSE2(job, s, len);
+#endif
+  return searchHorspool(job, s, len);
+}
+
+void searchAddSeg(struct searchJob *job, const char *text, size_t len, int line, int fileline, int lines) {
+  if (job -> nsegs == job -> segcap) {
+    job -> segcap = job -> segcap ? job -> segcap * 2 : 64;
+    job -> segs = (searchSeg*) realloc(job -> segs, sizeof(searchSeg) * job -> segcap);
+  }
+  searchSeg *seg = &job -> segs[job -> nsegs++];
+  seg -> text = text;
+  seg -> len = len;
+  seg -> line = line;
+  seg -> fileline = fileline;
+  seg -> lines = lines;
+}
+
+// Lists the document as segments in line order, cutting the run that holds
+// line `from` so that scanning can start exactly there.
+void searchSnapshot(struct searchJob *job, int from) {
+  int line = 0;
+  job -> first = -1;
+  for (rowNode *n = P.rows ? nodeFirst(P.rows) : NULL; n; n = nodeNext(n)) {
+    if (n -> fileline < 0) {
+      if (line == from) job -> first = job -> nsegs;
+      searchAddSeg(job, n -> row.chars, n -> row.size, line, -1, 1);
+    } else {
+      int f = n -> fileline;
+      int cut = (from > line && from < line + n -> lines) ? from - line : 0;
+      if (cut) searchAddSeg(job, &P.map[editorLineOffset(f)], editorLineOffset(f + cut) - editorLineOffset(f), line, f, cut);
+      if (line + cut == from) job -> first = job -> nsegs;
+      searchAddSeg(job, &P.map[editorLineOffset(f + cut)], editorLineOffset(f + n -> lines) - editorLineOffset(f + cut),
+                   line + cut, f + cut, n -> lines - cut);
+    }
+    line += n -> lines;
+  }
+  if (job -> first < 0) job -> first = 0;
+}
+
+// Matches are collected in job -> found and published to the UI thread in
+// batches, to keep the lock out of the scanning loop.
+void searchFlush(struct searchJob *job) {
+  if (job -> nfound == 0) return;
+  pthread_mutex_lock(&job -> lock);
+  if (job -> nmatches + job -> nfound > job -> cap) {
+    while (job -> nmatches + job -> nfound > job -> cap) job -> cap = job -> cap ? job -> cap * 2 : 256;
+    job -> matches = (searchMatch*) realloc(job -> matches, sizeof(searchMatch) * job -> cap);
+  }
+  memcpy(&job -> matches[job -> nmatches], job -> found, sizeof(searchMatch) * job -> nfound);
+  job -> nmatches += job -> nfound;
+  pthread_mutex_unlock(&job -> lock);
+  job -> nfound = 0;
+}
+
+void searchAdd(struct searchJob *job, int line, int col, int len) {
+  searchMatch *match = &job -> found[job -> nfound++];
+  match -> line = line;
+  match -> col = col;
+  match -> len = len;
+  if (job -> nfound == 256) searchFlush(job);
+}
+
+// Index of the line of run segment `seg` that holds mapping offset `off`,
+// searched for upwards of file line `from`.
+int searchFileLine(searchSeg *seg, int from, size_t off) {
+  int hi = seg -> fileline + seg -> lines;
+  while (hi - from > 1) {
+    int mid = from + (hi - from) / 2;
+    if (editorLineOffset(mid) <= off) from = mid;
+    else hi = mid;
+  }
+  return from;
+}
+
+// Whether the query still matches at a previous query's match.
+int searchVerify(struct searchJob *job, searchMatch *c) {
+  int lo = 0, hi = job -> nsegs;
+  while (hi - lo > 1) {
+    int mid = lo + (hi - lo) / 2;
+    if (job -> segs[mid].line <= c -> line) lo = mid;
+    else hi = mid;
+  }
+  searchSeg *seg = &job -> segs[lo];
+  const char *s = seg -> text + c -> col;
+  if (seg -> fileline >= 0)
+    s = &P.map[editorLineOffset(seg -> fileline + (c -> line - seg -> line)) + c -> col];
+  if (s + job -> nlen > seg -> text + seg -> len) return 0;
+  return memcmp(s, job -> needle, job -> nlen) == 0;
+}
+
+void searchNarrow(struct searchJob *job) {
+  for (int k = 0; k < job -> ncands; k++) {
+    if ((k & 4095) == 0 && __atomic_load_n(&job -> cancel, __ATOMIC_RELAXED)) return;
+    searchMatch *c = &job -> cands[(job -> candfirst + k) % job -> ncands];
+    if (searchVerify(job, c)) searchAdd(job, c -> line, c -> col, job -> nlen);
+  }
+  searchFlush(job);
+  __atomic_store_n(&job -> done, 1, __ATOMIC_RELEASE);
+}
+
+// Runs are scanned a window at a time: a block of the trigram index when
+// the needle can use it, so blocks that cannot hold the needle are skipped
+// whole, or otherwise a fixed-size piece, so a cancel is noticed quickly.
+size_t searchWindowEnd(struct searchJob *job, searchSeg *seg, size_t pos) {
+  size_t end = pos + PICKLE_SEARCH_BLOCK;
+  if (job -> tri && seg -> fileline >= 0) {
+    size_t base = seg -> text - P.map;
+    end = ((base + pos) / PICKLE_TRIGRAM_BLOCK + 1) * PICKLE_TRIGRAM_BLOCK - base;
+  }
+  return end < seg -> len ? end : seg -> len;
+}
+
+int searchWindowMayMatch(struct searchJob *job, searchSeg *seg, size_t pos) {
+  if (job -> tri == NULL || seg -> fileline < 0) return 1;
+  int block = (seg -> text - P.map + pos) / PICKLE_TRIGRAM_BLOCK;
+  return trigramMayContain(job -> tri, block, job -> tris, job -> ntris);
+}
+
+struct searchLine {
+  struct searchJob *job;
+  int line;
+};
+
+void searchRegexFound(void *arg, int col, int len) {
+  struct searchLine *at = (struct searchLine*) arg;
+  searchAdd(at -> job, at -> line, col, len);
+}
+
+void searchRegexLine(struct searchJob *job, const char *s, int len, int line) {
+  if (len + 1 > job -> startscap) {
+    job -> startscap = len + 1;
+    job -> starts = (unsigned char*) realloc(job -> starts, job -> startscap);
+  }
+  struct searchLine at = {job, line};
+  rxLineMatches(job -> rx, s, len, job -> starts, searchRegexFound, &at);
+}
+
+// Runs the regex over every line of a segment that could match. Returns 0
+// if the search was cancelled.
+int searchRegexSeg(struct searchJob *job, searchSeg *seg) {
+  if (seg -> fileline < 0) {
+    if (job -> nlen == 0 || searchFind(job, seg -> text, seg -> len))
+      searchRegexLine(job, seg -> text, seg -> len, seg -> line);
+    return !__atomic_load_n(&job -> cancel, __ATOMIC_RELAXED);
+  }
+
+  int fl = seg -> fileline;
+  int end = seg -> fileline + seg -> lines;
+  size_t base = seg -> text - P.map;
+  size_t pos = 0;
+  while (fl < end) {
+    if (__atomic_load_n(&job -> cancel, __ATOMIC_RELAXED)) return 0;
+    int stop;
+    if (job -> nlen) {
+      // Only the line holding the next occurrence of the literal.
+      size_t wend = searchWindowEnd(job, seg, pos);
+      if (!searchWindowMayMatch(job, seg, pos)) {
+        pos = wend;
+        if (pos >= seg -> len) break;
+        fl = searchFileLine(seg, fl, base + pos);
+        continue;
+      }
+      size_t limit = wend + job -> nlen - 1;
+      if (limit > seg -> len) limit = seg -> len;
+      const char *m = searchFind(job, &seg -> text[pos], limit - pos);
+      if (m == NULL || (size_t) (m - seg -> text) >= wend) {
+        pos = wend;
+        if (pos >= seg -> len) break;
+        fl = searchFileLine(seg, fl, base + pos);
+        continue;
+      }
+      fl = searchFileLine(seg, fl, m - P.map);
+      stop = fl + 1;
+    } else {
+      // Lines are taken a batch at a time between cancel checks.
+      stop = fl + 1024 < end ? fl + 1024 : end;
+    }
+    for (; fl < stop; fl++) {
+      int len;
+      char *s = editorFileLine(fl, &len);
+      searchRegexLine(job, s, len, seg -> line + (fl - seg -> fileline));
+    }
+    searchFlush(job);
+    pos = editorLineOffset(fl) - base;
+  }
+  return 1;
+}
+
+void *searchWorker(void *arg) {
+  struct searchJob *job = (struct searchJob*) arg;
+
+  if (job -> narrow) {
+    searchNarrow(job);
+    return NULL;
+  }
+  for (int k = 0; k < job -> nsegs; k++) {
+    searchSeg *seg = &job -> segs[(job -> first + k) % job -> nsegs];
+    if (job -> rx) {
+      if (!searchRegexSeg(job, seg)) return NULL;
+      continue;
+    }
+    int fl = seg -> fileline;
+    size_t pos = 0;
+    while (pos < seg -> len) {
+      if (__atomic_load_n(&job -> cancel, __ATOMIC_RELAXED)) return NULL;
+      size_t stop = searchWindowEnd(job, seg, pos);
+      if (!searchWindowMayMatch(job, seg, pos)) {
+        pos = stop;
+        continue;
+      }
+      size_t limit = stop + job -> nlen - 1;
+      if (limit > seg -> len) limit = seg -> len;
+      const char *m;
+      while (pos < stop && (m = searchFind(job, &seg -> text[pos], limit - pos)) != NULL) {
+        size_t at = m - seg -> text;
+        if (at >= stop) break;
+        if (fl < 0) {
+          searchAdd(job, seg -> line, at, job -> nlen);
+        } else {
+          size_t off = m - P.map;
+          fl = searchFileLine(seg, fl, off);
+          searchAdd(job, seg -> line + (fl - seg -> fileline), off - editorLineOffset(fl), job -> nlen);
+        }
+        pos = at + 1;
+      }
+      searchFlush(job);
+      pos = stop > pos ? stop : pos;
+    }
+  }
+  searchFlush(job);
+  __atomic_store_n(&job -> done, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+#define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
+
+/*** Syntax HighLighting ***/
+
+int is_separator(int c) {
+  return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+}
+
+// Each syntax is compiled, when it is first selected, into a transition
+// table: one row per lexer state -- between words, in a word, in a number,
+// in a string or right after an escape in one, some way into the end of a
+// multi-line comment, some way into what may be a comment delimiter -- and
+// one column per byte class, bytes that behave alike in every state sharing
+// a class. An entry gives where the row of the state the byte leads to
+// starts, the highlight the byte gets, and the odd thing still left to do:
+// look a keyword up, or mark where a delimiter may start, turned out not to,
+// or did. The lexer is then a loop that looks every byte up in the row of
+// its state, and goes over the bytes that leave state and highlight as they
+// are -- the rest of a word, the inside of a comment or string -- in a
+// tighter loop still, on the entry each row keeps last for them.
+//
+// Lines that are only followed, not highlighted, get a table of their own,
+// in which states that differ only in how they highlight are merged. Most
+// syntaxes are left with a single state outside comments and strings, and
+// the lexer goes over whole lines of code in that tighter loop.
+//
+// A delimiter is only known to be one once its last byte is seen, so the
+// states on the way to it wait, and on a byte that does not fit the lexer
+// goes back to the first one and takes it for what it is on its own, from
+// a column of its own. The end of a multi-line comment needs no going back:
+// its states follow every prefix of it that could still be completed.
+//
+// Keywords go into a trie whose edges are indexed by a second byte class:
+// every byte that appears in some keyword gets a column of its own, and all
+// other bytes share column 0, which never leads anywhere. Matching a word
+// then costs its length rather than a strncmp per keyword.
+
+#define LX_SEP (1 << 0)
+#define LX_OPEN (1 << 1)
+#define LX_KEYWORD (1 << 2)
+
+#define LX_MAXSTATES 64
+#define LX_NEXT 0xffff
+#define LX_HL(e) (((e) >> 16) & 15)
+#define LX_A_KEYWORD (1 << 20)
+#define LX_A_CAND (1 << 21)
+#define LX_A_BACK (1 << 22)
+#define LX_A_DELIM (1 << 23)
+#define LX_ACTIONS (LX_A_KEYWORD | LX_A_CAND | LX_A_BACK | LX_A_DELIM)
+#define LX_SPAN (1 << 24)
+#define LX_NOSTAY 0xffffffff
+
+#define LS_SEP 0
+#define LS_WORD 1
+#define LS_NUMBER 2
+
+struct keywordTrie {
+  unsigned char cls[256];
+  int cols;
+  int nnodes, cap;
+  int *next;
+  unsigned char *kind;
+};
+
+// Rows from `comment` on are those of states inside a multi-line comment,
+// and from `waiting` on those of states that wait to see whether a
+// delimiter ends up there.
+// `stays` has 256 bytes for each row, set for the bytes that leave state
+// and highlight as they are; rows are a power of two apart, 1 << `shift`.
+struct lexTable {
+  unsigned int *next;
+  unsigned char *stays;
+  int shift;
+  int comment, waiting;
+};
+
+struct syntaxLexer {
+  unsigned char flags[256];
+  unsigned char cls[256];
+  unsigned char plain[256];
+  int ncls;
+  struct lexTable mark, scan;
+  // How many bytes a delimiter may take to be decided.
+  int reach;
+  struct keywordTrie *keywords;
+};
+
+// What syntaxCompile needs while it fills the table in.
+struct lexBuild {
+  struct editorSyntax *syn;
+  const unsigned char *flags;
+  const char *delim[2];
+  int dlen[2];
+  const char *mce;
+  int mce_len;
+  int border[LX_MAXSTATES];
+  int str[256];
+  int quote[LX_MAXSTATES];
+  const char *wait[LX_MAXSTATES];
+  int waitlen[LX_MAXSTATES];
+  int comment, waiting, chars, nstates;
+};
+
+struct keywordTrie *keywordCompile(char **keywords) {
+  struct keywordTrie *t = (struct keywordTrie*) calloc(1, sizeof(struct keywordTrie));
+  for (int j = 0; keywords[j]; j++)
+    for (const char *s = keywords[j]; *s; s++)
+      if (!t -> cls[(unsigned char) *s] && !(*s == '|' && s[1] == '\0'))
+        t -> cls[(unsigned char) *s] = ++t -> cols;
+  t -> cols++;
+  t -> nnodes = 1;
+  t -> cap = 64;
+  t -> next = (int*) calloc(t -> cap * t -> cols, sizeof(int));
+  t -> kind = (unsigned char*) calloc(t -> cap, 1);
+
+  for (int j = 0; keywords[j]; j++) {
+    int klen = strlen(keywords[j]);
+    int kw2 = keywords[j][klen - 1] == '|';
+    if (kw2) klen--;
+    int node = 0;
+    for (int k = 0; k < klen; k++) {
+      int *edge = &t -> next[node * t -> cols + t -> cls[(unsigned char) keywords[j][k]]];
+      if (*edge == 0) {
+        if (t -> nnodes == t -> cap) {
+          t -> cap *= 2;
+          t -> next = (int*) realloc(t -> next, sizeof(int) * t -> cap * t -> cols);
+          t -> kind = (unsigned char*) realloc(t -> kind, t -> cap);
+          memset(&t -> next[t -> nnodes * t -> cols], 0, sizeof(int) * (t -> cap - t -> nnodes) * t -> cols);
+          memset(&t -> kind[t -> nnodes], 0, t -> cap - t -> nnodes);
+          edge = &t -> next[node * t -> cols + t -> cls[(unsigned char) keywords[j][k]]];
+        }
+        *edge = t -> nnodes++;
+      }
+      node = *edge;
+    }
+    // An earlier entry for the same word wins, as it did when the list was
+    // walked in order.
+    if (klen && !t -> kind[node]) t -> kind[node] = kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
+  }
+  return t;
+}
+
+// The waiting state for having seen the `len` bytes at `p` of a delimiter,
+// or -1 if there is none.
+int lexWaiting(struct lexBuild *b, const char *p, int len) {
+  for (int st = b -> waiting; st < b -> nstates; st++)
+    if (b -> waitlen[st] == len && !memcmp(b -> wait[st], p, len)) return st;
+  return -1;
 }
 
-// Disable Raw Mode
-void disableRawMode() {
-  tcsetattr(STDIN_FILENO, TCSAFLUSH, &P.orig_termios);
+// The transition for `c` after the `len` bytes at `p`, which are the start
+// of some delimiter. The line comment is tried first, as it always was.
+unsigned int lexDelimiter(struct lexBuild *b, const char *p, int len, int c) {
+  char seen[LX_MAXSTATES + 1];
+  memcpy(seen, p, len);
+  seen[len] = c;
+  for (int d = 0; d < 2; d++)
+    if (b -> dlen[d] == len + 1 && !memcmp(b -> delim[d], seen, len + 1))
+      return LX_A_DELIM | (d ? HL_MLCOMMENT << 16 | b -> comment : HL_COMMENT << 16 | LS_SEP);
+  int st = lexWaiting(b, seen, len + 1);
+  return st == -1 ? LX_A_BACK : st;
 }
 
-// Input Flags
-void enableRawMode() {
-  if (tcgetattr(STDIN_FILENO, &P.orig_termios) == -1){
-    die("tcgetattr");
+// The transition out of state `st` for byte `c`. With `plain`, `c` is taken
+// for what it is on its own, after it failed to start a delimiter.
+unsigned int lexStep(struct lexBuild *b, int st, int c, int plain) {
+  struct editorSyntax *syn = b -> syn;
+  // A character literal waits for its closing quote: right after the
+  // opening one, after a backslash, and after the character.
+  if (b -> chars && st == b -> chars) {
+    if (c == '\\') return st + 1;
+    return c == '\'' ? LX_A_BACK : st + 2;
+  }
+  if (b -> chars && st == b -> chars + 1) return st + 1;
+  if (b -> chars && st == b -> chars + 2) return c == '\'' ? LX_A_DELIM | HL_STRING << 16 | LS_SEP : LX_A_BACK;
+  if (st >= b -> waiting) return lexDelimiter(b, b -> wait[st], b -> waitlen[st], c);
+  if (st >= b -> comment) {
+    int k = st - b -> comment;
+    while (k && c != (unsigned char) b -> mce[k]) k = b -> border[k];
+    if (c == (unsigned char) b -> mce[k]) k++;
+    if (k == b -> mce_len) return HL_MLCOMMENT << 16 | LS_SEP;
+    return HL_MLCOMMENT << 16 | (b -> comment + k);
+  }
+  if (b -> quote[st] < 0) return HL_STRING << 16 | (st - 1);
+  if (b -> quote[st]) {
+    if (c == '\\') return HL_STRING << 16 | (st + 1);
+    if (c == b -> quote[st]) return HL_STRING << 16 | LS_SEP;
+    return HL_STRING << 16 | st;
   }
-  atexit(disableRawMode);
 
-  #define CTRL_KEY(k) ((k) & 0x1f)
+  int quotes = !(syn -> flags & HL_QUOTES_START_WORDS) || st == LS_SEP;
+  if (!plain) {
+    unsigned int e = lexDelimiter(b, "", 0, c);
+    if (!(e & LX_A_BACK)) return LX_A_CAND | e;
+    if (b -> chars && c == '\'' && quotes) return LX_A_CAND | b -> chars;
+  }
+  if (b -> str[c] && quotes) return HL_STRING << 16 | b -> str[c];
+  if ((syn -> flags & HL_HIGHLIGHT_NUMBERS) && ((isdigit(c) && st != LS_WORD) || (c == '.' && st == LS_NUMBER)))
+    return HL_NUMBER << 16 | LS_NUMBER;
+  if (st == LS_SEP && (b -> flags[c] & LX_KEYWORD)) return LX_A_KEYWORD | LS_WORD;
+  return b -> flags[c] & LX_SEP ? LS_SEP : LS_WORD;
+}
 
-  struct termios raw = P.orig_termios;
+// An entry as the scan table has it: no keyword to look up, and no
+// highlight but that of a line comment, which ends the line.
+unsigned int lexScanEntry(unsigned int e) {
+  e &= ~LX_A_KEYWORD;
+  if (!(e & LX_A_DELIM) || LX_HL(e) != HL_COMMENT) e &= ~(15 << 16);
+  return e;
+}
 
-  raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
-  raw.c_oflag &= ~(OPOST);
-  raw.c_cflag |= (CS8);
-  raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
-  raw.c_cc[VMIN] = 0;
-  raw.c_cc[VTIME] = 1;
+// Whether states `st` and `u` of `next` are in the same set of `merged` and
+// lead to the same sets, doing the same as far as the scan table goes.
+int lexAlike(const unsigned int *next, int ncls, const int *merged, int st, int u) {
+  if (merged[st] != merged[u]) return 0;
+  for (int j = 0; j < ncls; j++) {
+    unsigned int e = lexScanEntry(next[st * ncls + j]), f = lexScanEntry(next[u * ncls + j]);
+    if ((e & ~LX_NEXT) != (f & ~LX_NEXT) || merged[e & LX_NEXT] != merged[f & LX_NEXT]) return 0;
+  }
+  return 1;
+}
 
-  if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) die("tcsetattr");
+// Sorts the states of `next` into sets of states the scan table cannot tell
+// apart, numbered in the order of their first state: states outside comments,
+// inside them, and waiting on a delimiter start out in three sets, which are
+// split until every state of a set leads to the same sets.
+void lexMerge(const unsigned int *next, int nstates, int ncls, int *merged, int comment, int waiting) {
+  for (int st = 0; st < nstates; st++) merged[st] = (st >= comment) + (st >= waiting);
+  int nsets = 0, before;
+  do {
+    before = nsets;
+    int first[LX_MAXSTATES], split[LX_MAXSTATES];
+    nsets = 0;
+    for (int st = 0; st < nstates; st++) {
+      int k = 0;
+      while (k < nsets && !lexAlike(next, ncls, merged, st, first[k])) k++;
+      if (k == nsets) first[nsets++] = st;
+      split[st] = k;
+    }
+    memcpy(merged, split, sizeof(int) * nstates);
+  } while (nsets != before);
 }
 
-struct appendBuffer{
-  char *b;
-  int len;
-};
+// Lays the table out from `next`, with one row for every set of `merged`
+// and a last entry in each that stays in it, for lines to be highlighted
+// or, with `scan`, only followed.
+void lexTableFill(struct lexTable *t, const unsigned int *next, int nstates, int ncls, const unsigned char *cls,
+                  const int *merged, int comment, int waiting, int scan) {
+  int nrows = 0;
+  for (int st = 0; st < nstates; st++)
+    if (merged[st] >= nrows) nrows = merged[st] + 1;
+  t -> shift = 0;
+  while ((1 << t -> shift) < ncls + 1) t -> shift++;
+  int stride = 1 << t -> shift;
+  t -> next = (unsigned int*) calloc(nrows * stride, sizeof(unsigned int));
+  t -> stays = (unsigned char*) calloc(nrows, 256);
+  t -> comment = (comment < nstates ? merged[comment] : nrows) * stride;
+  t -> waiting = (waiting < nstates ? merged[waiting] : nrows) * stride;
+  for (int st = 0; st < nstates; st++) {
+    unsigned int *row = &t -> next[merged[st] * stride];
+    row[ncls] = LX_NOSTAY;
+    for (int j = 0; j < ncls; j++) {
+      unsigned int e = next[st * ncls + j];
+      if (scan) e = lexScanEntry(e);
+      e = (e & ~LX_NEXT) | merged[e & LX_NEXT] * stride;
+      row[j] = e;
+      if ((int) (e & LX_NEXT) == merged[st] * stride && !(e & LX_ACTIONS) && row[ncls] == LX_NOSTAY) row[ncls] = e;
+    }
+    for (int c = 0; c < 256; c++) t -> stays[merged[st] * 256 + c] = row[cls[c]] == row[ncls];
+  }
+  // An entry whose byte gets the highlight the bytes staying in its state
+  // after it get lets the lexer go over those at once.
+  for (int k = 0; k < nrows * stride; k += stride)
+    for (int j = 0; j < ncls; j++) {
+      unsigned int e = t -> next[k + j];
+      if (!(e & LX_ACTIONS) && LX_HL(t -> next[(e & LX_NEXT) + ncls]) == LX_HL(e)) t -> next[k + j] |= LX_SPAN;
+    }
+}
 
-#define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
+struct syntaxLexer *syntaxCompile(struct editorSyntax *syn) {
+  struct syntaxLexer *lx = (struct syntaxLexer*) calloc(1, sizeof(struct syntaxLexer));
+  struct lexBuild b;
+  memset(&b, 0, sizeof(b));
+  b.syn = syn;
+  b.flags = lx -> flags;
+  for (int c = 0; c < 256; c++)
+    if (is_separator((char) c)) lx -> flags[c] |= LX_SEP;
+  for (int j = 0; syn -> keywords[j]; j++)
+    if (syn -> keywords[j][0] != '|') lx -> flags[(unsigned char) syn -> keywords[j][0]] |= LX_KEYWORD;
+  lx -> keywords = keywordCompile(syn -> keywords);
+
+  // A string takes two states, the second for right after a backslash.
+  // With HL_CHAR_LITERALS a single quote only opens a character literal,
+  // which has states of its own further on.
+  b.nstates = LS_NUMBER + 1;
+  if (syn -> flags & HL_HIGHLIGHT_STRINGS)
+    for (const char *q = syn -> flags & HL_CHAR_LITERALS ? "\"" : "\"'"; *q; q++) {
+      b.str[(unsigned char) *q] = b.nstates;
+      b.quote[b.nstates++] = *q;
+      b.quote[b.nstates++] = -1;
+    }
 
-/*** Syntax HighLighting ***/
+  b.delim[0] = syn -> singleline_comment_start;
+  b.dlen[0] = b.delim[0] ? strlen(b.delim[0]) : 0;
+  if (syn -> multiline_comment_start && syn -> multiline_comment_end &&
+      syn -> multiline_comment_start[0] && syn -> multiline_comment_end[0]) {
+    b.delim[1] = syn -> multiline_comment_start;
+    b.dlen[1] = strlen(b.delim[1]);
+    b.mce = syn -> multiline_comment_end;
+    b.mce_len = strlen(b.mce);
+  }
+  // The comment states count the bytes of its end seen so far; on one that
+  // does not fit, the count falls back to the longest of them that still
+  // could be the start of the end.
+  b.comment = b.nstates;
+  b.nstates += b.mce_len;
+  for (int k = 2; k < b.mce_len; k++)
+    for (int j = k - 1; j > 0; j--)
+      if (!memcmp(b.mce, b.mce + k - j, j)) {
+        b.border[k] = j;
+        break;
+      }
+  b.waiting = b.nstates;
+  lx -> reach = 1;
+  for (int d = 0; d < 2; d++) {
+    if (b.dlen[d] == 0) continue;
+    lx -> flags[(unsigned char) b.delim[d][0]] |= LX_OPEN;
+    if (b.dlen[d] > lx -> reach) lx -> reach = b.dlen[d];
+    for (int k = 1; k < b.dlen[d]; k++)
+      if (lexWaiting(&b, b.delim[d], k) == -1) {
+        b.wait[b.nstates] = b.delim[d];
+        b.waitlen[b.nstates++] = k;
+      }
+  }
+  if ((syn -> flags & HL_HIGHLIGHT_STRINGS) && (syn -> flags & HL_CHAR_LITERALS)) {
+    lx -> flags['\''] |= LX_OPEN;
+    if (lx -> reach < 4) lx -> reach = 4;
+    b.chars = b.nstates;
+    b.nstates += 3;
+  }
 
-int is_separator(int c) {
-  return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+  // Every byte gets a column, and so does every byte that may start a
+  // delimiter, taken on its own. Columns alike in every state share a class.
+  int ncols = 256, plaincol[256], rep[256 + 2];
+  unsigned char colcls[256 + 2];
+  unsigned int (*col)[LX_MAXSTATES] = (unsigned int (*)[LX_MAXSTATES]) malloc(sizeof(*col) * (256 + 2));
+  for (int c = 0; c < 256; c++) {
+    for (int st = 0; st < b.nstates; st++) col[c][st] = lexStep(&b, st, c, 0);
+    plaincol[c] = c;
+    if (lx -> flags[c] & LX_OPEN) {
+      for (int st = 0; st < b.nstates; st++) col[ncols][st] = lexStep(&b, st, c, 1);
+      plaincol[c] = ncols++;
+    }
+  }
+  for (int k = 0; k < ncols; k++) {
+    int j = 0;
+    while (j < lx -> ncls && memcmp(col[rep[j]], col[k], sizeof(unsigned int) * b.nstates)) j++;
+    if (j == lx -> ncls) rep[lx -> ncls++] = k;
+    colcls[k] = j;
+  }
+  for (int c = 0; c < 256; c++) {
+    lx -> cls[c] = colcls[c];
+    lx -> plain[c] = colcls[plaincol[c]];
+  }
+  unsigned int *next = (unsigned int*) malloc(sizeof(unsigned int) * b.nstates * lx -> ncls);
+  for (int st = 0; st < b.nstates; st++)
+    for (int j = 0; j < lx -> ncls; j++) next[st * lx -> ncls + j] = col[rep[j]][st];
+  free(col);
+
+  int merged[LX_MAXSTATES];
+  for (int st = 0; st < b.nstates; st++) merged[st] = st;
+  lexTableFill(&lx -> mark, next, b.nstates, lx -> ncls, lx -> cls, merged, b.comment, b.waiting, 0);
+  lexMerge(next, b.nstates, lx -> ncls, merged, b.comment, b.waiting);
+  lexTableFill(&lx -> scan, next, b.nstates, lx -> ncls, lx -> cls, merged, b.comment, b.waiting, 1);
+  free(next);
+  return lx;
 }
 
-void editorUpdateSyntax(erow *row) {
-  row -> highlight = (unsigned char*) realloc(row -> highlight, row -> rsize);
-  memset(row -> highlight, HL_NORMAL, row -> rsize);
+// Returns the length of the keyword `s` starts with, if it is followed by a
+// separator or the end, and its highlight in `*hl`; otherwise 0.
+int keywordMatch(struct syntaxLexer *lx, const char *s, int len, int *hl) {
+  struct keywordTrie *t = lx -> keywords;
+  int node = 0;
+  for (int k = 0; ; k++) {
+    if (t -> kind[node] && (k == len || (lx -> flags[(unsigned char) s[k]] & LX_SEP))) {
+      *hl = t -> kind[node];
+      return k;
+    }
+    if (k == len) return 0;
+    node = t -> next[node * t -> cols + t -> cls[(unsigned char) s[k]]];
+    if (node == 0) return 0;
+  }
+}
 
-    if (P.syntax == NULL){
+// Gives rendered characters [at, at + len) of `row` highlight `hl`, growing
+// the last run instead when it ends right there with the same highlight.
+void editorRowMark(erow *row, int at, int len, int hl) {
+  if (len <= 0) return;
+  if (row -> nhl) {
+    hlRun *last = &row -> hl[row -> nhl - 1];
+    if (last -> hl == hl && last -> start + last -> len == at) {
+      last -> len += len;
       return;
     }
+  }
+  int need = (row -> nhl + 1) * sizeof(hlRun);
+  if (need > row -> hlcap)
+    row -> hl = (hlRun*) storeReserve((char*) row -> hl, &row -> hlcap, need * 2, row -> nhl * sizeof(hlRun));
+  hlRun *run = &row -> hl[row -> nhl++];
+  run -> start = at;
+  run -> len = len;
+  run -> hl = hl;
+}
 
-    char **keywords = P.syntax -> keywords;
-
-    char *scs = P.syntax->singleline_comment_start;
-    char *mcs = P.syntax->multiline_comment_start;
-    char *mce = P.syntax->multiline_comment_end;
-
-    int scs_len = scs ? strlen(scs) : 0;
-    int mcs_len = mcs ? strlen(mcs) : 0;
-    int mce_len = mce ? strlen(mce) : 0;
-
-    int prev_sep = 1;
-    int in_string = 0;
-    int in_comment = (row -> idx > 0 && P.row[row -> idx - 1].hl_open_comment);
-
+// Index of the first highlight run of `row` that ends after rendered
+// character `at`, or row -> nhl if there is none.
+int hlRunFind(erow *row, int at) {
+  int lo = 0, hi = row -> nhl;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (row -> hl[mid].start + row -> hl[mid].len <= at) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
 
-    int i = 0;
-    while (i < row -> rsize) {
-      char c = row -> render[i];
-      unsigned char prev_hl = (i > 0) ? row -> highlight[i - 1] : HL_NORMAL;
-      if (scs_len && !in_string && !in_comment) {
-        if (!strncmp(&row -> render[i], scs, scs_len)) {
-          memset(&row -> highlight[i], HL_COMMENT, row -> rsize - i);
-          break;
-        }
+// Lexes the `len` bytes of `s`, starting inside a multi-line comment if
+// `in_comment` is set, and returns whether it ends inside one. Given `row`,
+// whose runs must have been cleared, it also records the highlight runs of
+// `s` there; without it nothing is marked and no keyword looked up, which is
+// all it takes to carry the state through lines that are not loaded.
+int editorLex(struct syntaxLexer *lx, const char *s, int len, erow *row, int in_comment) {
+  const struct lexTable *t = row ? &lx -> mark : &lx -> scan;
+  const unsigned int *next = t -> next;
+  const unsigned char *cls = lx -> cls;
+  int ncls = lx -> ncls;
+  // `st` is where the row of the current state starts, `m` is where a
+  // delimiter may have started and `back` the state before it, and `start`
+  // is where the run of highlight `hl` the bytes go into starts.
+  int st = in_comment && t -> comment < t -> waiting ? t -> comment : 0;
+  int i = 0, m = 0, back = 0;
+  int start = 0, hl = HL_NORMAL;
+  for (;;) {
+    unsigned int e;
+    if (i < len) e = next[st + cls[(unsigned char) s[i]]];
+    else if (st >= t -> waiting) e = LX_A_BACK;
+    else break;
+
+    if (e & LX_ACTIONS) {
+      if (e & LX_A_BACK) {
+        i = m;
+        st = back;
+        e = next[st + lx -> plain[(unsigned char) s[i]]];
       }
-
-      if (mcs_len && mce_len && !in_string) {
-        if (in_comment) {
-          row -> highlight[i] = HL_MLCOMMENT;
-          if (!strncmp(&row -> render[i], mce, mce_len)) {
-            memset(&row -> highlight[i], HL_MLCOMMENT, mce_len);
-            i += mce_len;
-            in_comment = 0;
-            prev_sep = 1;
-            continue;
-          } else {
-            i++;
-            continue;
-          }
-        } else if (!strncmp(&row -> render[i], mcs, mcs_len)) {
-          memset(&row -> highlight[i], HL_MLCOMMENT, mcs_len);
-          i += mcs_len;
-          in_comment = 1;
-          continue;
-        }
+      if (e & LX_A_CAND) {
+        m = i;
+        back = st;
       }
-
-      if (P.syntax -> flags & HL_HIGHLIGHT_STRINGS) {
-        if (in_string) {
-          row -> highlight[i] = HL_STRING;
-          if (c == '\\' && i + 1 < row -> rsize) {
-            row -> highlight[i + 1] = HL_STRING;
-            i += 2;
-            continue;
-          }
-          if (c == in_string) in_string = 0;
-          i++;
-          prev_sep = 1;
-          continue;
-        } else {
-          if (c == '"' || c == '\'') {
-            in_string = c;
-            row -> highlight[i] = HL_STRING;
-            i++;
-            continue;
-          }
+      if (e & LX_A_DELIM) {
+        if (row && hl) editorRowMark(row, start, m - start, hl);
+        start = m;
+        hl = LX_HL(e);
+        if (hl == HL_COMMENT) {
+          if (row) editorRowMark(row, m, len - m, HL_COMMENT);
+          return 0;
         }
+        st = e & LX_NEXT;
+        i++;
+        continue;
       }
-
-      if(P.syntax -> flags & HL_HIGHLIGHT_NUMBERS) {
-        if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) || (c == '.' && prev_hl == HL_NUMBER) ){
-          row -> highlight[i] = HL_NUMBER;
-          i++;
-          prev_sep = 0;
+      if (e & LX_A_KEYWORD) {
+        int kind;
+        int klen = keywordMatch(lx, &s[i], len - i, &kind);
+        if (klen) {
+          if (hl) editorRowMark(row, start, i - start, hl);
+          editorRowMark(row, i, klen, kind);
+          i += klen;
+          start = i;
+          hl = HL_NORMAL;
+          st = e & LX_NEXT;
           continue;
         }
       }
+    }
 
-      if (prev_sep) {
-        int j;
-        for (j = 0; keywords[j]; j++) {
-          int klen = strlen(keywords[j]);
-          int kw2 = keywords[j][klen - 1] == '|';
-          if (kw2) klen--;
-          if (!strncmp(&row -> render[i], keywords[j], klen) &&
-              is_separator(row -> render[i + klen])) {
-            memset(&row -> highlight[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-            i += klen;
-            break;
-          }
-        }
-        if (keywords[j] != NULL) {
-          prev_sep = 0;
-          continue;
-        }
+    if ((int) LX_HL(e) != hl) {
+      if (row && hl) editorRowMark(row, start, i - start, hl);
+      start = i;
+      hl = LX_HL(e);
+    }
+    st = e & LX_NEXT;
+    i++;
+    if (e & LX_SPAN) {
+      const unsigned char *stays = &t -> stays[(st >> t -> shift) << 8];
+      while (i + 4 <= len && stays[(unsigned char) s[i]] && stays[(unsigned char) s[i + 1]] &&
+             stays[(unsigned char) s[i + 2]] && stays[(unsigned char) s[i + 3]])
+        i += 4;
+      while (i < len && stays[(unsigned char) s[i]]) i++;
+    }
+  }
+  if (row && hl) editorRowMark(row, start, len - start, hl);
+  return st >= t -> comment;
+}
+
+void editorUpdateSyntax(erow *row, int in_comment) {
+  row -> nhl = 0;
+  if (P.syntax == NULL) {
+    row -> hl_open_comment = 0;
+    return;
+  }
+  row -> hl_open_comment = editorLex(P.syntax -> lexer, row -> render, row -> rsize, row, in_comment);
+}
+
+// Whether the lexer is between words right after s[at - 1], whatever came
+// before: that is a separator that cannot start a delimiter, with no byte
+// that can start one close enough before it for that one to be still
+// undecided.
+int lexSettled(struct syntaxLexer *lx, const char *s, int at) {
+  if ((lx -> flags[(unsigned char) s[at - 1]] & (LX_SEP | LX_OPEN)) != LX_SEP) return 0;
+  for (int k = 2; k <= lx -> reach && k <= at; k++)
+    if (lx -> flags[(unsigned char) s[at - k]] & LX_OPEN) return 0;
+  return 1;
+}
+
+// Lexes rendered characters [from, to) of `row` again, after they replaced
+// ones that were `delta` fewer, keeping the runs on either side. Once the
+// lexer goes past a separator outside any run that lexSettled accepts, what
+// follows no longer depends on what came before. So it is
+// restarted after the last such separator before `from`, and stops after the
+// first one past `to` that it finds the same way again. Should the edit have
+// opened a string or a comment, that separator is inside it now, and the
+// lexer is let go twice as far, up to the end of the row.
+void editorRelex(erow *row, int from, int to, int delta) {
+  struct syntaxLexer *lx = P.syntax -> lexer;
+  const char *s = row -> render;
+  hlRun *hl = row -> hl;
+  int n = row -> nhl;
+  int oldsize = row -> rsize - delta;
+
+  int p = from;
+  int j = hlRunFind(row, p - 1);
+  if (j == n || hl[j].start > p - 1) j--;
+  while (p > 0) {
+    if (j >= 0 && hl[j].start + hl[j].len >= p) {
+      p = hl[j].start;
+      j--;
+      continue;
+    }
+    if (lexSettled(lx, s, p)) break;
+    p--;
+  }
+  int in_comment = p == 0 ? row -> hl_in - 1 : 0;
+
+  // `c` is the separator to stop after, as an old position; the old runs
+  // from index `b` on lie past it and are kept.
+  erow part;
+  memset(&part, 0, sizeof(erow));
+  int c = to - delta;
+  int b;
+  for (;;) {
+    b = hlRunFind(row, c);
+    while (c < oldsize) {
+      if (b < n && hl[b].start <= c) {
+        c = hl[b].start + hl[b].len;
+        b++;
+        continue;
       }
+      if (lexSettled(lx, s, c + delta + 1)) break;
+      c++;
+    }
+    int end = c < oldsize ? c + delta + 1 : row -> rsize;
+    part.nhl = 0;
+    int out = editorLex(lx, &s[p], end - p, &part, in_comment);
+    if (end == row -> rsize) {
+      row -> hl_open_comment = out;
+      b = n;
+      break;
+    }
+    hlRun *last = part.nhl ? &part.hl[part.nhl - 1] : NULL;
+    if (!out && !(last && p + last -> start + last -> len == end)) break;
+    c += end - p;
+  }
 
-      prev_sep = is_separator(c);
-      i++;  
+  int total = j + 1 + part.nhl + n - b;
+  if (total * (int) sizeof(hlRun) > row -> hlcap)
+    row -> hl = (hlRun*) storeReserve((char*) row -> hl, &row -> hlcap, total * sizeof(hlRun), n * sizeof(hlRun));
+  hl = row -> hl;
+  memmove(&hl[j + 1 + part.nhl], &hl[b], (n - b) * sizeof(hlRun));
+  for (int i = 0; i < part.nhl; i++) {
+    hl[j + 1 + i] = part.hl[i];
+    hl[j + 1 + i].start += p;
   }
+  if (delta)
+    for (int i = j + 1 + part.nhl; i < total; i++) hl[i].start += delta;
+  row -> nhl = total;
+  storeFree(part.hl, part.hlcap);
+}
 
-  int changed = (row -> hl_open_comment != in_comment);
-  row -> hl_open_comment = in_comment;
-  if (changed && row -> idx + 1 < P.numrows)
-    editorUpdateSyntax(&P.row[row -> idx + 1]);
+// Follows a line through the comment and string rules of the highlighter
+// without producing any highlight, and returns whether it ends inside a
+// multi-line comment. Used to carry the lexer state through lines that are
+// not loaded.
+int editorSyntaxScan(const char *s, int len, int in_comment) {
+  if (P.syntax == NULL) return 0;
+  return editorLex(P.syntax -> lexer, s, len, NULL, in_comment);
 }
 
 int editorSyntaxToColor(int highlight) {
@@ -264,7 +2898,9 @@ int editorSyntaxToColor(int highlight) {
 }
 
 void editorSelectSyntaxHighlight() {
+  editorHighlightStop();
   P.syntax = NULL;
+  P.edit.row = NULL;
   if (P.filename == NULL) return;
   char *ext = strrchr(P.filename, '.');
   for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
@@ -275,11 +2911,12 @@ void editorSelectSyntaxHighlight() {
       if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
           (!is_ext && strstr(P.filename, s->filematch[i]))) {
         P.syntax = s;
+        if (s -> lexer == NULL) s -> lexer = syntaxCompile(s);
 
-        int filerow;
-        for (filerow = 0; filerow < P.numrows; filerow++) {
-          editorUpdateSyntax(&P.row[filerow]);
-        }        
+        editorLineStateReserve();
+        memset(P.linestate, 0, P.maplines);
+        docMarkDirty(P.rows);
+        if (P.indexer == NULL) editorHighlightStart();
        
        
         return;
@@ -289,22 +2926,228 @@ void editorSelectSyntaxHighlight() {
   }
 }
 
-#define APPENDBUFFER_INIT {NULL, 0}
+#define APPENDBUFFER_INIT {NULL, 0, 0}
+
+// Makes room for `len` more bytes and returns where they go, or NULL if the
+// buffer could not grow.
+char *abReserve(struct appendBuffer *ab, size_t len){
+  if (ab -> len + len > ab -> cap) {
+    size_t cap = ab -> cap ? ab -> cap : 4096;
+    while (cap < ab -> len + len) cap *= 2;
+    char *buff = (char*)realloc(ab -> b, cap);
+    if (buff == NULL) return NULL;
+    ab -> b = buff;
+    ab -> cap = cap;
+  }
+  char *p = &ab -> b[ab -> len];
+  ab -> len += len;
+  return p;
+}
 
-void abAppend(struct appendBuffer *ab, const char *s, int len){
-  char *buff = (char*)realloc(ab -> b, ab -> len + len);
+void abAppend(struct appendBuffer *ab, const char *s, size_t len){
+  char *p = abReserve(ab, len);
+  if (p) memcpy(p, s, len);
+}
 
-  if (buff == NULL) return;
-  memcpy(&buff[ab -> len], s, len);
-  ab -> b = buff;
-  ab -> len += len;
+void abReset(struct appendBuffer *ab){
+  ab -> len = 0;
 }
 
 void abFree(struct appendBuffer *ab){
   free(ab -> b);
+  ab -> b = NULL;
+  ab -> len = ab -> cap = 0;
+}
+
+/*** screen ***/
+
+// Every refresh draws into P.frame, a grid of cells covering the whole
+// terminal. P.shadow holds the frame that was last written out, and only the
+// cells that differ from it are sent to the terminal.
+
+screenCell *screenRow(int y) {
+  return &P.frame[y * P.framecols];
+}
+
+void screenClearRow(int y) {
+  screenCell *cells = screenRow(y);
+  for (int x = 0; x < P.framecols; x++) {
+    cells[x].ch = ' ';
+    cells[x].attr = HL_NORMAL;
+  }
+}
+
+// Writes `len` bytes at column `x` of row `y`, clipped to the screen width.
+int screenPut(int y, int x, const char *s, int len, int attr) {
+  screenCell *cells = screenRow(y);
+  int j;
+  for (j = 0; j < len && x < P.framecols; j++, x++) {
+    cells[x].ch = s[j];
+    cells[x].attr = attr;
+  }
+  return x;
+}
+
+void screenResize() {
+  int rows = P.screenrows + 2;
+  if (P.frame && P.framerows == rows && P.framecols == P.screencols) return;
+  free(P.frame);
+  free(P.shadow);
+  P.framerows = rows;
+  P.framecols = P.screencols;
+  P.frame = (screenCell*) malloc(sizeof(screenCell) * rows * P.screencols);
+  P.shadow = (screenCell*) malloc(sizeof(screenCell) * rows * P.screencols);
+  P.shadowvalid = 0;
+}
+
+// Foreground escape for every highlight class, built once at startup.
+struct {
+  char seq[8];
+  int len;
+} sgrColor[HL_MATCH + 1];
+
+void screenBuildSgr() {
+  for (int hl = HL_NORMAL; hl <= HL_MATCH; hl++) {
+    int color = (hl == HL_NORMAL) ? 39 : editorSyntaxToColor(hl);
+    sgrColor[hl].len = snprintf(sgrColor[hl].seq, sizeof(sgrColor[hl].seq), "\x1b[%dm", color);
+  }
+}
+
+void abSetAttr(struct appendBuffer *ab, int *current, int attr) {
+  if (*current == attr) return;
+  if ((*current & CELL_INVERSE) && !(attr & CELL_INVERSE)) {
+    abAppend(ab, "\x1b[m", 3);
+    *current = HL_NORMAL;
+  }
+  if (!(*current & CELL_INVERSE) && (attr & CELL_INVERSE))
+    abAppend(ab, "\x1b[7m", 4);
+  int hl = attr & ~CELL_INVERSE;
+  if ((*current & ~CELL_INVERSE) != hl)
+    abAppend(ab, sgrColor[hl].seq, sgrColor[hl].len);
+  *current = attr;
+}
+
+int screenRowLength(screenCell *cells) {
+  int len = P.framecols;
+  while (len > 0 && cells[len - 1].ch == ' ' && cells[len - 1].attr == HL_NORMAL)
+    len--;
+  return len;
+}
+
+int screenRowIsAscii(screenCell *cells, int len) {
+  for (int x = 0; x < len; x++)
+    if ((unsigned char) cells[x].ch >= 0x80) return 0;
+  return 1;
 }
 
-void welcomeScreenDraw(struct appendBuffer *ab, const char message[]) {
+int screenRowsEqual(screenCell *a, screenCell *b) {
+  return !memcmp(a, b, sizeof(screenCell) * P.framecols);
+}
+
+// When the view moved by a few rows since the last frame, lets the terminal
+// move the text area itself: a scroll region covering just the text rows is
+// set, and line feeds at its bottom (or reverse indexes at its top) shift it,
+// leaving the status and message bars alone. The shadow is shifted the same
+// way, so only the rows scrolled into view differ from it afterwards.
+void screenScroll(struct appendBuffer *ab) {
+  int delta = P.rowoff - P.shadowrowoff;
+  int rows = P.screenrows;
+  int n = delta < 0 ? -delta : delta;
+  if (!P.shadowvalid || delta == 0 || n >= rows) return;
+
+  int kept = 0, stay = 0;
+  for (int y = 0; y < rows; y++) {
+    int from = y + delta;
+    if (from >= 0 && from < rows &&
+        screenRowsEqual(screenRow(y), &P.shadow[from * P.framecols]))
+      kept++;
+    if (screenRowsEqual(screenRow(y), &P.shadow[y * P.framecols])) stay++;
+  }
+  if (kept <= stay) return;
+
+  char buf[32];
+  int blen = snprintf(buf, sizeof(buf), "\x1b[1;%dr", rows);
+  abAppend(ab, buf, blen);
+  blen = snprintf(buf, sizeof(buf), "\x1b[%d;1H", delta > 0 ? rows : 1);
+  abAppend(ab, buf, blen);
+  for (int i = 0; i < n; i++) {
+    if (delta > 0) abAppend(ab, "\n", 1);
+    else abAppend(ab, "\x1bM", 2);
+  }
+  abAppend(ab, "\x1b[r", 3);
+
+  screenCell *shadow = P.shadow;
+  size_t rowbytes = sizeof(screenCell) * P.framecols;
+  if (delta > 0) {
+    memmove(shadow, &shadow[n * P.framecols], rowbytes * (rows - n));
+  } else {
+    memmove(&shadow[n * P.framecols], shadow, rowbytes * (rows - n));
+  }
+  int blank = delta > 0 ? rows - n : 0;
+  for (int y = blank; y < blank + n; y++) {
+    for (int x = 0; x < P.framecols; x++) {
+      shadow[y * P.framecols + x].ch = ' ';
+      shadow[y * P.framecols + x].attr = HL_NORMAL;
+    }
+  }
+}
+
+// Appends what it takes to turn the last emitted frame into P.frame. Rows
+// holding non-ASCII bytes are rewritten whole, since their byte columns need
+// not match the terminal's.
+void screenFlush(struct appendBuffer *ab) {
+  int attr = HL_NORMAL;
+  screenScroll(ab);
+  for (int y = 0; y < P.framerows; y++) {
+    screenCell *cells = screenRow(y);
+    screenCell *old = &P.shadow[y * P.framecols];
+    int newlen = screenRowLength(cells);
+    int oldlen = P.shadowvalid ? screenRowLength(old) : 0;
+
+    int first = 0;
+    int last = P.framecols - 1;
+    if (P.shadowvalid) {
+      while (first < P.framecols && cells[first].ch == old[first].ch &&
+             cells[first].attr == old[first].attr)
+        first++;
+      if (first == P.framecols) continue;
+      while (cells[last].ch == old[last].ch && cells[last].attr == old[last].attr)
+        last--;
+      if (!screenRowIsAscii(cells, newlen) || !screenRowIsAscii(old, oldlen)) {
+        first = 0;
+        last = P.framecols - 1;
+      }
+    }
+
+    char buf[32];
+    int blen = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, first + 1);
+    abAppend(ab, buf, blen);
+
+    // Past `newlen` the new row is blank, so a change reaching that far is
+    // an erase to the end of the line.
+    int end = (last + 1 < newlen) ? last + 1 : newlen;
+    int x = first;
+    while (x < end) {
+      int run = x + 1;
+      while (run < end && cells[run].attr == cells[x].attr) run++;
+      abSetAttr(ab, &attr, cells[x].attr);
+      char *p = abReserve(ab, run - x);
+      if (p == NULL) break;
+      for (; x < run; x++) *p++ = cells[x].ch;
+    }
+    if (last >= newlen) {
+      abSetAttr(ab, &attr, HL_NORMAL);
+      abAppend(ab, "\x1b[K", 3);
+    }
+  }
+  abSetAttr(ab, &attr, HL_NORMAL);
+
+  memcpy(P.shadow, P.frame, sizeof(screenCell) * P.framerows * P.framecols);
+  P.shadowvalid = 1;
+  P.shadowrowoff = P.rowoff;
+}
+
+void welcomeScreenDraw(int y, const char message[]) {
   char ch[80];
 
   int lenght = snprintf(ch, sizeof(ch), message, PICKLE_VERSION);
@@ -312,17 +3155,19 @@ void welcomeScreenDraw(struct appendBuffer *ab, const char message[]) {
   if (lenght > P.screencols) lenght = P.screencols;
 
   int padding = (P.screencols - lenght) / 2;
+  int x = 0;
 
   if (padding) {
-    abAppend(ab, "-", 1);
+    x = screenPut(y, x, "-", 1, HL_NORMAL);
     padding--;
   }
 
-  while (padding--) abAppend(ab, " ", 1);
-  abAppend(ab, ch, lenght);
+  x += padding;
+  screenPut(y, x, ch, lenght, HL_NORMAL);
 }
 
 int editorRowCxToRx(erow *row, int cx) {
+  if (!memchr(row -> chars, '\t', cx)) return cx;
   int rx = 0;
   int j;
   for (j = 0; j < cx; j++) {
@@ -334,6 +3179,7 @@ int editorRowCxToRx(erow *row, int cx) {
 }
 
 int editorRowRxToCx(erow *row, int rx) {
+  if (!memchr(row -> chars, '\t', row -> size)) return rx < row -> size ? rx : row -> size;
   int cur_rx = 0;
   int cx;
   for (cx = 0; cx < row -> size; cx++){
@@ -349,7 +3195,7 @@ int editorRowRxToCx(erow *row, int rx) {
 void editorScroll() {
   P.rx = 0;
   if (P.cy < P.numrows) {
-    P.rx = editorRowCxToRx(&P.row[P.cy], P.cx);
+    P.rx = editorRowCxToRx(editorRowAt(P.cy), P.cx);
   }
   if (P.cy < P.rowoff) {
     P.rowoff = P.cy;
@@ -365,100 +3211,135 @@ void editorScroll() {
   }
 }
 
-void editorDrawRows(struct appendBuffer *ab) {
+// A row that was only looked at holds nothing that cannot be rebuilt from the
+// mapping, so once enough of them pile up, the ones away from the screen and
+// the cursor go back into runs.
+void editorReleaseRows() {
+  struct rowStore *s = &P.store;
+  if (s -> borrowed < PICKLE_ROW_KEEP || s -> borrowed < s -> nodes / 4) return;
+  int lo = P.rowoff - P.screenrows;
+  int hi = P.rowoff + 2 * P.screenrows;
+  int *at = (int*) malloc(sizeof(int) * s -> borrowed);
+  int n = 0, pos = 0;
+  for (rowNode *x = P.rows ? nodeFirst(P.rows) : NULL; x; x = nodeNext(x)) {
+    if (x -> fileline < 0 && x -> row.mapped && (pos < lo || pos > hi) && pos != P.cy)
+      at[n++] = pos;
+    pos += x -> lines;
+  }
+  for (int i = 0; i < n; i++) editorRowRelease(at[i]);
+  free(at);
+}
+
+// Gives cells [from, to) of a row, counted in rendered columns, attribute
+// `attr`, where the row is drawn from column P.coloff and `len` cells long.
+void screenPaint(screenCell *cells, int len, int from, int to, int attr) {
+  from -= P.coloff;
+  to -= P.coloff;
+  if (from < 0) from = 0;
+  if (to > len) to = len;
+  for (int x = from; x < to; x++) cells[x].attr = attr;
+}
+
+// Paints the highlight runs of `row` that reach into the visible columns,
+// and the search match over them.
+void editorDrawHighlight(erow *row, screenCell *cells, int len) {
+  for (int k = hlRunFind(row, P.coloff); k < row -> nhl && row -> hl[k].start < P.coloff + len; k++)
+    screenPaint(cells, len, row -> hl[k].start, row -> hl[k].start + row -> hl[k].len, row -> hl[k].hl);
+
+  struct searchJob *job = P.search;
+  if (job && job -> marked == row) {
+    int col = job -> mark.col < row -> size ? job -> mark.col : row -> size;
+    int end = col + job -> mark.len < row -> size ? col + job -> mark.len : row -> size;
+    screenPaint(cells, len, editorRowCxToRx(row, col), editorRowCxToRx(row, end), HL_MATCH);
+  }
+}
+
+void editorDrawRows() {
   int y;
+  erow *row = editorRowAt(P.rowoff);
 
   for (y = 0; y < P.screenrows; y++) {
-    
-    int filerow = y + P.rowoff;
-    
-    if (filerow >= P.numrows){
+    screenClearRow(y);
+
+    if (row == NULL){
       if (P.numrows == 0 && y == P.screenrows / 3) {
-        welcomeScreenDraw(ab, "Pickle editor -- version %s");
+        welcomeScreenDraw(y, "Pickle editor -- version %s");
       } else if (P.numrows == 0 && y == ((P.screenrows)/3)+1){
-        welcomeScreenDraw(ab, "Press 'Ctrl+Q' to Quit");
+        welcomeScreenDraw(y, "Press 'Ctrl+Q' to Quit");
       }else{
-        abAppend(ab, "-", 1);
+        screenPut(y, 0, "-", 1, HL_NORMAL);
       }
     } else {
+      editorRowRender(row);
     
-      int len = P.row[filerow].rsize - P.coloff;
+      int len = row -> rsize - P.coloff;
       if (len < 0) len = 0;
       if (len > P.screencols) len = P.screencols;
       
-      char *c = &P.row[filerow].render[P.coloff];
-      
-      unsigned char *highlight = &P.row[filerow].highlight[P.coloff];
-      int current_color = -1;
+      char *c = &row -> render[P.coloff];
+      screenCell *cells = screenRow(y);
 
       int j;
+      for (j = 0; j < len; j++) cells[j].ch = c[j];
+      editorDrawHighlight(row, cells, len);
       for (j = 0; j < len; j++) {
-         if (iscntrl(c[j])) {
-          char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-          abAppend(ab, "\x1b[7m", 4);
-          abAppend(ab, &sym, 1);
-          abAppend(ab, "\x1b[m", 3);
-          if (current_color != -1) {
-            char buff[16];
-            int clen = snprintf(buff, sizeof(buff), "\x1b[%dm", current_color);
-            abAppend(ab, buff, clen);
-          }
-         } else if (highlight[j] == HL_NORMAL) {
-          if (current_color != -1) {
-            abAppend(ab, "\x1b[39m", 5);
-            current_color = -1;
-          }
-          abAppend(ab, &c[j], 1);
-        } else {
-          int color = editorSyntaxToColor(highlight[j]);
-          if (color != current_color) {
-            current_color = color;
-            char buff[16];
-            int clen = snprintf(buff, sizeof(buff), "\x1b[%dm", color);
-            abAppend(ab, buff, clen);
-          }
-          abAppend(ab, &c[j], 1);
+        if (iscntrl(c[j])) {
+          cells[j].ch = (c[j] <= 26) ? '@' + c[j] : '?';
+          cells[j].attr = CELL_INVERSE;
         }
       }
 
-      abAppend(ab, "\x1b[K", 3);
+      row = editorRowNext(row);
     }
-    abAppend(ab, "\x1b[K", 3);
-    abAppend(ab, "\r\n", 2);
   }
 }
 
-void editorDrawStatusBar(struct appendBuffer *ab){
-  abAppend(ab, "\x1b[7m", 4);
+void editorDrawStatusBar(){
+  int y = P.screenrows;
+  screenClearRow(y);
 
   char status[80], rstatus[80];
-  int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
+  int len = snprintf(status, sizeof(status), "%.20s - %d%s lines %s",
     P.filename ? P.filename : "[No Name]", P.numrows,
-    P.trash ? "(modified)" : "");
+    P.indexer ? "+" : "", P.trash ? "(modified)" : "");
   
   int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
     P.syntax ? P.syntax->filetype : "no filetype", P.cy + 1, P.numrows);
 
   if (len > P.screencols) len = P.screencols;
-    abAppend(ab, status, len);
+  screenPut(y, 0, status, len, CELL_INVERSE);
   while (len < P.screencols){
     if(P.screencols - len == rlen){
-      abAppend(ab, rstatus, rlen);
+      screenPut(y, len, rstatus, rlen, CELL_INVERSE);
       break;
     }
-      abAppend(ab, " ", 1);
-      len++;
+    screenPut(y, len, " ", 1, CELL_INVERSE);
+    len++;
   }
-  abAppend(ab, "\x1b[m", 3);
-  abAppend(ab, "\r\n", 2);
 }
 
-void editorDrawMessageBar(struct appendBuffer *ab) {
-  abAppend(ab, "\x1b[K", 3);
+void editorDrawMessageBar() {
+  int y = P.screenrows + 1;
+  screenClearRow(y);
   int msglen = strlen(P.statusmsg);
   if (msglen > P.screencols) msglen = P.screencols;
   if (msglen && time(NULL) - P.statusmsg_time < 5)
-    abAppend(ab, P.statusmsg, msglen);
+    screenPut(y, 0, P.statusmsg, msglen, HL_NORMAL);
+
+  // Match count of the search in progress, with a '+' until the scan ends.
+  struct searchJob *job = P.search;
+  if (job) {
+    job -> drawndone = __atomic_load_n(&job -> done, __ATOMIC_ACQUIRE);
+    job -> drawn = __atomic_load_n(&job -> nmatches, __ATOMIC_RELAXED);
+    char count[64];
+    int clen;
+    if (job -> error)
+      clen = snprintf(count, sizeof(count), "regex: %s", job -> error);
+    else
+      clen = snprintf(count, sizeof(count), "%s[%d/%d%s]", job -> rx ? "regex " : "",
+        job -> current + 1, job -> drawn, job -> drawndone ? "" : "+");
+    if (clen < P.screencols) screenPut(y, P.screencols - clen, count, clen, HL_NORMAL);
+  }
 }
 
 void editorSetStatusMessage(const char *fmt, ...){
@@ -471,44 +3352,96 @@ void editorSetStatusMessage(const char *fmt, ...){
 
 // Clear Screen
 void editorRefreshScreen() {
+  editorReleaseRows();
   editorScroll();
-  struct appendBuffer ab = APPENDBUFFER_INIT;
+  screenResize();
+  struct appendBuffer *ab = &P.out;
+  abReset(ab);
 
-  abAppend(&ab, "\x1b[?25l", 6);
-  abAppend(&ab, "\x1b[H", 3);
+  abAppend(ab, "\x1b[?25l", 6);
 
-  editorDrawRows(&ab);
-  editorDrawStatusBar(&ab);
-  editorDrawMessageBar(&ab);
+  editorDrawRows();
+  editorDrawStatusBar();
+  editorDrawMessageBar();
+  screenFlush(ab);
 
   char buf[32];
   snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (P.cy - P.rowoff) + 1, (P.rx - P.coloff) + 1);
-  abAppend(&ab, buf, strlen(buf));
+  abAppend(ab, buf, strlen(buf));
+
+  abAppend(ab, "\x1b[?25h", 6);
+
+  write(STDOUT_FILENO, ab -> b, ab -> len);
+}
 
-  abAppend(&ab, "\x1b[?25h", 6);
+/*** input ***/
+
+// Keys are read from a ring buffer that is refilled with everything the
+// terminal has pending in one go, so a paste costs a few syscalls instead of
+// one per byte, and the main loop can apply every queued key before drawing.
+
+// Waits up to `timeout` ms (-1 = forever) for stdin, then reads as much as
+// fits. Returns the number of bytes added.
+int inputFill(int timeout) {
+  struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+  int total = 0;
+
+  if (timeout != 0 && poll(&pfd, 1, timeout) == -1 && errno != EINTR) die("poll");
+  while (P.inhead - P.intail < PICKLE_INPUT_RING) {
+    unsigned int at = P.inhead % PICKLE_INPUT_RING;
+    unsigned int room = PICKLE_INPUT_RING - (P.inhead - P.intail);
+    if (room > PICKLE_INPUT_RING - at) room = PICKLE_INPUT_RING - at;
+    int nread = read(STDIN_FILENO, &P.input[at], room);
+    if (nread == -1 && errno != EAGAIN && errno != EINTR) die("read");
+    if (nread <= 0) break;
+    P.inhead += nread;
+    total += nread;
+  }
+  return total;
+}
+
+int inputPending() {
+  if (P.inhead == P.intail) inputFill(0);
+  return P.inhead != P.intail;
+}
 
-  write(STDOUT_FILENO, ab.b, ab.len);
-  abFree(&ab);
+// Takes the next byte, waiting up to `timeout` ms for one to arrive.
+int inputGet(char *c, int timeout) {
+  if (P.inhead == P.intail) inputFill(timeout);
+  if (P.inhead == P.intail) return 0;
+  *c = P.input[P.intail++ % PICKLE_INPUT_RING];
+  return 1;
 }
 
 // Read Bytes
 int editorReadKey() {
-  int nread;
   char c;
 
-  while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-    if (nread == -1 && errno != EAGAIN) die("read");
+  while (!inputGet(&c, 0)) {
+    int changed = editorIndexPoll();
+    if (editorSearchPoll()) changed = 1;
+    if (editorSavePoll()) changed = 1;
+    if (editorHighlightPoll()) changed = 1;
+    if (changed) editorRefreshScreen();
+    editorSyntaxIdle();
+
+    int timeout = -1;
+    if (P.search && !P.search -> drawndone) timeout = PICKLE_SEARCH_POLL;
+    if (P.save) timeout = PICKLE_SAVE_POLL;
+    if (P.highlighter) timeout = PICKLE_HL_POLL;
+    if (P.indexer) timeout = PICKLE_INDEX_POLL;
+    inputFill(timeout);
   }
 
   if (c == '\x1b') {
     char seq[3];
 
-    if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-    if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
+    if (!inputGet(&seq[0], PICKLE_ESC_TIMEOUT)) return '\x1b';
+    if (!inputGet(&seq[1], PICKLE_ESC_TIMEOUT)) return '\x1b';
 
     if (seq[0] == '[') {
       if (seq[1] >= '0' && seq[1] <= '9') {
-        if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
+        if (!inputGet(&seq[2], PICKLE_ESC_TIMEOUT)) return '\x1b';
         if (seq[2] == '~') {
           switch (seq[1]) {
             case '1': return HOME_KEY;
@@ -519,6 +3452,12 @@ int editorReadKey() {
             case '7': return HOME_KEY;
             case '8': return END_KEY;
           }
+        } else if (seq[1] == '2' && seq[2] == '0') {
+          char end[2];
+          if (!inputGet(&end[0], PICKLE_ESC_TIMEOUT)) return '\x1b';
+          if (!inputGet(&end[1], PICKLE_ESC_TIMEOUT)) return '\x1b';
+          if (end[0] == '0' && end[1] == '~') return PASTE_START;
+          if (end[0] == '1' && end[1] == '~') return PASTE_END;
         }
       } else {
         switch (seq[1]) {
@@ -549,7 +3488,7 @@ char *editorPrompt(const char *prompt, void (*callback)(const char *, int)) {
   buff[0] = '\0';
   while (1) {
     editorSetStatusMessage(prompt, buff);
-    editorRefreshScreen();
+    if (!inputPending()) editorRefreshScreen();
     int ch = editorReadKey();
     
     if (ch == DEL_KEY || ch == CTRL_KEY('h') || ch == BACKSPACE) {
@@ -590,7 +3529,7 @@ int getCursorPosition(int *rows, int *cols) {
   if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4) return -1;
 
   while (i < sizeof(buf) - 1) {
-    if (read(STDIN_FILENO, &buf[i], 1) != 1) break;
+    if (!inputGet(&buf[i], PICKLE_ESC_TIMEOUT)) break;
     if (buf[i] == 'R') break;
     i++;
   }
@@ -622,7 +3561,7 @@ int getWindowSize(int *rows, int *cols){
 }
 
 void editorMoveCursor(int key){
-  erow *row = (P.cy >= P.numrows) ? NULL : &P.row[P.cy];
+  erow *row = editorRowAt(P.cy);
 
   switch (key){
     case ARROW_LEFT:
@@ -630,7 +3569,7 @@ void editorMoveCursor(int key){
         P.cx--;
       } else if (P.cy > 0){
         P.cy--;
-        P.cx = P.row[P.cy].size;
+        P.cx = editorRowAt(P.cy) -> size;
       }
       break;
 
@@ -653,7 +3592,7 @@ void editorMoveCursor(int key){
       break;
   }
 
-  row = (P.cy >= P.numrows) ? NULL : &P.row[P.cy];
+  row = editorRowAt(P.cy);
   int rowlenght = row ? row -> size : 0;
 
   if (P.cx > rowlenght) {
@@ -662,15 +3601,409 @@ void editorMoveCursor(int key){
 }
 
 
+/*** journal ***/
+
+// Every change to the document is also appended to a journal next to the
+// file, .<name>.pickle-journal, so that the changes of a session that died
+// can be replayed on top of the file at the next start. A change is a small
+// binary record; records are collected in memory, and a syncer thread writes
+// and fsyncs them as a group at most once every PICKLE_JOURNAL_SYNC ms, so
+// the disk never holds up a keystroke. The journal starts with the size and
+// mtime of the file the changes apply to. It is created by the first change
+// and goes away once the changes are saved or thrown away on quitting.
+
+enum journalOp {
+  JOURNAL_INSERT = 1,  // text, possibly several lines, at `line`, `col`
+  JOURNAL_DELETE,      // `len` bytes from `line`, `col` on, across lines too
+  JOURNAL_TRUNCATE,    // the rest of `line` from `col` on
+  JOURNAL_INSERT_ROW,  // a new line `line` holding the text
+  JOURNAL_DEL_ROW      // line `line`
+};
+
+typedef struct journalHeader {
+  char magic[8];
+  long long size, mtime, mtimensec;
+} journalHeader;
+
+// Each record is this, followed by `len` bytes of text for the inserts.
+typedef struct journalRecordHeader {
+  unsigned char op;
+  int line, col, len;
+} __attribute__((packed)) journalRecordHeader;
+
+struct journal {
+  char *path;
+  journalHeader header;
+  int fd;
+  struct appendBuffer pending;
+  size_t length;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  int stop;
+  int threaded;
+  pthread_t thread;
+};
+
+void journalRecord(int op, int line, int col, const char *s, int len) {
+  struct journal *j = P.journal;
+  if (j == NULL) return;
+  journalRecordHeader rec = {(unsigned char) op, line, col, len};
+  int textlen = (op == JOURNAL_INSERT || op == JOURNAL_INSERT_ROW) ? len : 0;
+  pthread_mutex_lock(&j -> lock);
+  abAppend(&j -> pending, (const char*) &rec, sizeof(rec));
+  abAppend(&j -> pending, s, textlen);
+  j -> length += sizeof(rec) + textlen;
+  pthread_cond_signal(&j -> wake);
+  pthread_mutex_unlock(&j -> lock);
+}
+
+void journalSetHeader(struct journal *j, struct stat *st) {
+  memcpy(j -> header.magic, PICKLE_JOURNAL_MAGIC, 8);
+  j -> header.size = st -> st_size;
+  j -> header.mtime = st -> st_mtim.tv_sec;
+  j -> header.mtimensec = st -> st_mtim.tv_nsec;
+}
+
+int journalWriteAll(int fd, const char *s, size_t len) {
+  while (len > 0) {
+    ssize_t w = write(fd, s, len);
+    if (w == -1) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    s += w;
+    len -= w;
+  }
+  return 0;
+}
+
+// Commits a group of records, creating the journal first if need be. Once
+// anything fails the journal is given up on rather than left with a hole.
+void journalCommit(struct journal *j, struct appendBuffer *group) {
+  if (j -> fd == -1) {
+    j -> fd = open(j -> path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (j -> fd == -1) {
+      j -> fd = -2;
+      return;
+    }
+    if (journalWriteAll(j -> fd, (const char*) &j -> header, sizeof(j -> header)) == -1) {
+      close(j -> fd);
+      j -> fd = -2;
+      return;
+    }
+  }
+  if (j -> fd < 0) return;
+  if (journalWriteAll(j -> fd, group -> b, group -> len) == -1 || fdatasync(j -> fd) == -1) {
+    close(j -> fd);
+    j -> fd = -2;
+  }
+}
+
+void *journalWorker(void *arg) {
+  struct journal *j = (struct journal*) arg;
+  struct appendBuffer group = APPENDBUFFER_INIT;
+  pthread_mutex_lock(&j -> lock);
+  while (1) {
+    if (j -> pending.len == 0) {
+      if (j -> stop) break;
+      pthread_cond_wait(&j -> wake, &j -> lock);
+      continue;
+    }
+    struct appendBuffer t = group;
+    group = j -> pending;
+    j -> pending = t;
+    pthread_mutex_unlock(&j -> lock);
+    journalCommit(j, &group);
+    abReset(&group);
+
+    // Whatever comes in meanwhile waits for the next group.
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_nsec += PICKLE_JOURNAL_SYNC * 1000000L;
+    until.tv_sec += until.tv_nsec / 1000000000L;
+    until.tv_nsec %= 1000000000L;
+    pthread_mutex_lock(&j -> lock);
+    while (!j -> stop && pthread_cond_timedwait(&j -> wake, &j -> lock, &until) != ETIMEDOUT);
+  }
+  pthread_mutex_unlock(&j -> lock);
+  abFree(&group);
+  return NULL;
+}
+
+void journalRun(struct journal *j) {
+  j -> stop = 0;
+  if (pthread_create(&j -> thread, NULL, journalWorker, j) == 0) j -> threaded = 1;
+}
+
+// Commits what is left and waits for the syncer to finish.
+void journalHalt(struct journal *j) {
+  pthread_mutex_lock(&j -> lock);
+  j -> stop = 1;
+  pthread_cond_signal(&j -> wake);
+  pthread_mutex_unlock(&j -> lock);
+  if (j -> threaded) pthread_join(j -> thread, NULL);
+  j -> threaded = 0;
+  if (j -> pending.len) journalCommit(j, &j -> pending);
+  abReset(&j -> pending);
+}
+
+// Sets up journaling of the changes to `filename`, whose state on disk is
+// `st`. With `fd` != -1 an existing journal is carried on with.
+void journalStart(const char *filename, struct stat *st, int fd, size_t length) {
+  struct journal *j = (struct journal*) calloc(1, sizeof(struct journal));
+  const char *slash = strrchr(filename, '/');
+  int dirlen = slash ? slash - filename + 1 : 0;
+  j -> path = (char*) malloc(strlen(filename) + 32);
+  sprintf(j -> path, "%.*s.%s.pickle-journal", dirlen, filename, filename + dirlen);
+  journalSetHeader(j, st);
+  j -> fd = fd;
+  j -> length = length;
+  pthread_mutex_init(&j -> lock, NULL);
+  pthread_cond_init(&j -> wake, NULL);
+  P.journal = j;
+  journalRun(j);
+}
+
+// Throws the journal away, as when quitting without saving on purpose.
+void journalDiscard() {
+  struct journal *j = P.journal;
+  if (j == NULL) return;
+  journalHalt(j);
+  if (j -> fd >= 0) close(j -> fd);
+  unlink(j -> path);
+  abFree(&j -> pending);
+  free(j -> path);
+  free(j);
+  P.journal = NULL;
+}
+
+// Called once a save has written the document as it was when the journal
+// was `mark` bytes long. Those changes are now in the file, `st`, so only
+// the ones made since are kept, rebased on the new file.
+void journalRebase(const char *filename, struct stat *st, size_t mark) {
+  struct journal *j = P.journal;
+  if (j == NULL) {
+    journalStart(filename, st, -1, 0);
+    return;
+  }
+  journalHalt(j);
+  size_t tail = j -> length - mark;
+  char *rest = NULL;
+  if (tail && j -> fd >= 0) {
+    rest = (char*) malloc(tail);
+    if (pread(j -> fd, rest, tail, sizeof(journalHeader) + mark) != (ssize_t) tail) tail = 0;
+  }
+  if (j -> fd >= 0) close(j -> fd);
+  j -> fd = -1;
+  journalSetHeader(j, st);
+  j -> length = tail;
+  if (rest && tail) {
+    struct appendBuffer group = {rest, tail, tail};
+    j -> fd = open(j -> path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (j -> fd == -1 || journalWriteAll(j -> fd, (const char*) &j -> header, sizeof(j -> header)) == -1 ||
+        journalWriteAll(j -> fd, group.b, group.len) == -1 || fdatasync(j -> fd) == -1) {
+      if (j -> fd >= 0) close(j -> fd);
+      j -> fd = -2;
+    }
+  } else {
+    unlink(j -> path);
+  }
+  free(rest);
+  journalRun(j);
+}
+
+/*** undo ***/
+
+// Undo history is a log of the changes themselves, not of rows: each record
+// is a position and the bytes inserted or deleted there, packed one after
+// the other in a single buffer and followed by their own size so the log
+// can be walked both ways. Records made while handling one key form a
+// group, undone and redone together, and plain typing or deleting on the
+// same spot keeps growing the record before it instead of adding new ones.
+// Everything past `pos` can be redone until the next change. When the log
+// outgrows PICKLE_UNDO_MAX the oldest groups are dropped.
+
+enum undoOp {
+  UNDO_INSERT = 1,  // text, possibly several lines, at `line`, `col`
+  UNDO_DELETE,      // the same, taken out
+  UNDO_INSERT_ROW,  // a new line `line` holding the text
+  UNDO_DEL_ROW      // line `line`, which held the text
+};
+
+typedef struct undoRecordHeader {
+  unsigned char op;
+  unsigned char group;
+  int line, col, len;
+} __attribute__((packed)) undoRecordHeader;
+
+struct undoLog {
+  char *b;
+  size_t len, cap;
+  size_t pos;
+  size_t last;
+  int boundary;
+  int typing;
+  int mergeable;
+  int applying;
+};
+
+size_t undoRecordSize(int len) {
+  return sizeof(undoRecordHeader) + len + sizeof(unsigned int);
+}
+
+void undoReserve(struct undoLog *u, size_t len) {
+  if (u -> cap >= len) return;
+  u -> cap = u -> cap ? u -> cap : 4096;
+  while (u -> cap < len) u -> cap *= 2;
+  u -> b = (char*) realloc(u -> b, u -> cap);
+}
+
+// Drops whole groups from the front until the log fits again, with some
+// room to spare so that this does not happen on every change.
+void undoTrim(struct undoLog *u) {
+  if (u -> len <= PICKLE_UNDO_MAX) return;
+  size_t cut = 0;
+  while (cut < u -> pos && u -> len - cut > PICKLE_UNDO_MAX / 4 * 3) {
+    undoRecordHeader *h = (undoRecordHeader*) (u -> b + cut);
+    cut += undoRecordSize(h -> len);
+    while (cut < u -> pos && !((undoRecordHeader*) (u -> b + cut)) -> group)
+      cut += undoRecordSize(((undoRecordHeader*) (u -> b + cut)) -> len);
+  }
+  memmove(u -> b, u -> b + cut, u -> len - cut);
+  u -> len -= cut;
+  u -> pos -= cut;
+  if (u -> last != (size_t) -1) u -> last = u -> last >= cut ? u -> last - cut : (size_t) -1;
+  if (u -> last == (size_t) -1) u -> mergeable = 0;
+}
+
+// Makes the next change start a new group. A `typing` one may still carry
+// on the group before if that was typing at the same spot too.
+void undoBoundary(int typing) {
+  P.undo -> boundary = 1;
+  P.undo -> typing = typing;
+}
+
+// Tries to make a one-byte typing change part of the last record.
+int undoMerge(struct undoLog *u, int op, int line, int col, const char *s, int len) {
+  if (!u -> boundary || !u -> typing || !u -> mergeable || len != 1 || s[0] == '\n') return 0;
+  if (u -> last + undoRecordSize(((undoRecordHeader*) (u -> b + u -> last)) -> len) != u -> len) return 0;
+  undoRecordHeader *h = (undoRecordHeader*) (u -> b + u -> last);
+  if (h -> op != op || h -> line != line) return 0;
+  int before;
+  if (op == UNDO_INSERT && h -> col + h -> len == col) before = 0;
+  else if (op == UNDO_DELETE && h -> col == col) before = 0;
+  else if (op == UNDO_DELETE && h -> col == col + 1) before = 1;
+  else return 0;
+
+  undoReserve(u, u -> len + 1);
+  h = (undoRecordHeader*) (u -> b + u -> last);
+  char *text = (char*) (h + 1);
+  if (before) {
+    memmove(text + 1, text, h -> len);
+    text[0] = s[0];
+    h -> col = col;
+  } else {
+    text[h -> len] = s[0];
+  }
+  h -> len++;
+  unsigned int size = undoRecordSize(h -> len);
+  memcpy(text + h -> len, &size, sizeof(size));
+  u -> len++;
+  u -> pos = u -> len;
+  u -> boundary = 0;
+  return 1;
+}
+
+void undoRecord(int op, int line, int col, const char *s, int len) {
+  struct undoLog *u = P.undo;
+  if (u -> applying) return;
+  // A new change makes whatever was undone impossible to redo.
+  u -> len = u -> pos;
+  if (u -> last != (size_t) -1 && u -> last >= u -> len) {
+    u -> last = (size_t) -1;
+    u -> mergeable = 0;
+  }
+  if (undoMerge(u, op, line, col, s, len)) return;
+
+  size_t size = undoRecordSize(len);
+  undoReserve(u, u -> len + size);
+  undoRecordHeader h = {(unsigned char) op, (unsigned char) (u -> boundary || u -> len == 0), line, col, len};
+  if (h.group) u -> mergeable = u -> typing;
+  else u -> mergeable = 0;
+  u -> boundary = 0;
+  memcpy(u -> b + u -> len, &h, sizeof(h));
+  memcpy(u -> b + u -> len + sizeof(h), s, len);
+  unsigned int footer = size;
+  memcpy(u -> b + u -> len + sizeof(h) + len, &footer, sizeof(footer));
+  u -> last = u -> len;
+  u -> len += size;
+  u -> pos = u -> len;
+  undoTrim(u);
+}
+
 /*** row ***/
 
-void editorUpdateRow(erow *row) {
+// Rows are rendered and highlighted lazily: editing a row only marks it dirty,
+// and editorRowRender brings it up to date when it is about to be drawn or
+// searched.
+void editorUpdateRow(erow *row) {
+  if (P.edit.row == row) P.edit.row = NULL;
+  editorRowSetDirty(row, 1);
+}
+
+// Like editorUpdateRow, for when the `removed` chars at `at` have just been
+// replaced by `added` others. The span is remembered, so that a long row
+// that was up to date only has to be brought up to date around it.
+void editorRowEdited(erow *row, int at, int removed, int added) {
+  struct rowEdit *e = &P.edit;
+  if (e -> row != row) {
+    e -> row = ROW_NODE(row) -> dirty ? NULL : row;
+    e -> from = at;
+    e -> to = at + added;
+    e -> delta = added - removed;
+  } else {
+    int end = e -> to > at + removed ? e -> to : at + removed;
+    if (at < e -> from) e -> from = at;
+    e -> to = end + added - removed;
+    e -> delta += added - removed;
+  }
+  editorRowSetDirty(row, 1);
+}
+
+// Brings a long row without tabs up to date after an edit that brought in
+// none: its render is the same as its chars, so it is patched in place, and
+// only the part of it around the edit is lexed again.
+void editorRowPatch(erow *row, struct rowEdit *e) {
+  int oldsize = row -> rsize;
+  row -> render = storeReserve(row -> render, &row -> rendercap, row -> size + 1, oldsize + 1);
+  memmove(&row -> render[e -> to], &row -> render[e -> to - e -> delta], oldsize - (e -> to - e -> delta) + 1);
+  memcpy(&row -> render[e -> from], &row -> chars[e -> from], e -> to - e -> from);
+  row -> rsize = row -> size;
+
+  if (P.syntax == NULL) {
+    row -> nhl = 0;
+    row -> hl_open_comment = 0;
+    return;
+  }
+  editorRelex(row, e -> from, e -> to, e -> delta);
+}
+
+void editorRowRefresh(erow *row, int in_comment) {
+  editorSearchForget(row);
+  struct rowEdit e = P.edit;
+  P.edit.row = NULL;
+  if (e.row == row && row -> size >= PICKLE_LONG_ROW && row -> tabs == 0 && row -> hl_in == in_comment + 1 &&
+      !memchr(&row -> chars[e.from], '\t', e.to - e.from)) {
+    editorRowPatch(row, &e);
+    editorRowSetDirty(row, 0);
+    return;
+  }
+
   int tabs = 0;
   for (int i = 0; i < row -> size; i++)
     if (row -> chars[i] == '\t') tabs++;
 
-  free(row->render);
-  row->render = (char*)malloc(row->size + tabs*(PICKLE_TAB_STOP - 1) + 1);
+  row -> render = storeReserve(row -> render, &row -> rendercap, row -> size + tabs*(PICKLE_TAB_STOP - 1) + 1, 0);
 
   int index = 0;
   int j;
@@ -684,79 +4017,384 @@ void editorUpdateRow(erow *row) {
   }
   row -> render[index] = '\0';
   row -> rsize = index;
+  row -> tabs = tabs;
 
-  editorUpdateSyntax(row);
+  row -> hl_in = in_comment + 1;
+  editorUpdateSyntax(row, in_comment);
+  editorRowSetDirty(row, 0);
 }
 
-void editorInsertRow(int at, const char *s, size_t len) {
-  if (at < 0 || at > P.numrows){
+// Lexer state a node starts in, as recorded the last time it was highlighted.
+int nodeEntryState(rowNode *n) {
+  if (n -> fileline < 0) return n -> row.hl_in;
+  return P.linestate ? P.linestate[n -> fileline] : 0;
+}
+
+// Whether the last line of a clean node ends inside a multi-line comment.
+int nodeExitState(rowNode *n) {
+  if (n == NULL) return 0;
+  if (n -> fileline < 0) return n -> row.hl_open_comment;
+  int last = n -> fileline + n -> lines - 1;
+  int state = P.linestate ? P.linestate[last] : 0;
+  if (state == 0) return 0;
+  int len;
+  char *s = editorFileLine(last, &len);
+  return editorSyntaxScan(s, len, state - 1);
+}
+
+// Brings the highlighting of every row up to position `limit` up to date,
+// top to bottom, lexing at most `budget` lines. Each dirty node is lexed from
+// the state the node above it ends in; the node below only becomes dirty if
+// it was recorded as starting in a different state, so a change stops
+// spreading as soon as the lexer is back in step with what it saw before.
+// Returns 1 if dirty nodes are left anywhere.
+int editorSyntaxAdvance(int limit, int budget) {
+  rowNode *n;
+  int at;
+  while ((n = docFirstDirty(&at)) && at <= limit) {
+    if (budget <= 0) return 1;
+    int in_comment = nodeExitState(nodePrev(n));
+
+    if (n -> fileline < 0) {
+      editorRowRefresh(&n -> row, in_comment);
+      in_comment = n -> row.hl_open_comment;
+      budget--;
+    } else if (P.linestate) {
+      // Lines of a run never change, so once a line is found to start in
+      // the state recorded for it, the rest of the run is still valid.
+      int todo = n -> lines;
+      if (limit - at < todo) todo = limit - at + 1;
+      if (budget < todo) todo = budget;
+      int k, settled = 0;
+      for (k = 0; k < todo; k++) {
+        unsigned char *state = &P.linestate[n -> fileline + k];
+        if (*state == in_comment + 1) {
+          settled = 1;
+          break;
+        }
+        *state = in_comment + 1;
+        int len;
+        char *s = editorFileLine(n -> fileline + k, &len);
+        in_comment = editorSyntaxScan(s, len, in_comment);
+      }
+      budget -= k;
+      if (!settled && k < n -> lines) {
+        // Out of budget or past `limit`: cut the run so that the part not
+        // lexed yet stays dirty on its own.
+        rowNode *l, *r;
+        docSplit(P.rows, at + k, &l, &r);
+        docSetRoot(docMerge(l, r));
+        nodeSetDirty(n, 0);
+        continue;
+      }
+      nodeSetDirty(n, 0);
+      if (settled) continue;
+    } else {
+      nodeSetDirty(n, 0);
+      continue;
+    }
+
+    rowNode *next = nodeNext(n);
+    if (next && nodeEntryState(next) != in_comment + 1) nodeSetDirty(next, 1);
+  }
+  return nodeDirty(P.rows) != 0;
+}
+
+void editorRowRender(erow *row) {
+  editorSyntaxAdvance(editorRowIndex(row), INT_MAX);
+}
+
+// Keeps highlighting the rows off screen, a slice at a time, for as long as
+// no key is waiting.
+void editorSyntaxIdle() {
+  struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+  if (P.highlighter) return;
+  while (P.syntax && editorSyntaxAdvance(INT_MAX, PICKLE_HL_SLICE))
+    if (poll(&pfd, 1, 0) > 0) break;
+}
+
+// When a big file is opened with a syntax, or gets one, the lexer states of
+// all its lines are worked out by worker threads rather than a slice at a
+// time while idle. The file is cut into chunks of lines, each lexed as if it
+// started outside a comment. Once they are all done, the chunks are gone
+// through in order, and one that really starts inside a comment is lexed
+// again from there, but only until it is back in step with the first pass.
+// The main thread then fills in every line not lexed yet, and the idle pass
+// only has to check that each run starts in the state recorded for it.
+
+struct highlightJob {
+  struct syntaxLexer *lx;
+  int lines;
+  unsigned char *states;
+  unsigned char *exits;
+  int nchunks;
+  int next;
+  int finished;
+  int cancel;
+  int done;
+  pthread_t threads[PICKLE_INDEX_THREADS];
+  int nthreads;
+};
+
+// Lexes lines [from, to) starting in `in_comment`, recording the state each
+// starts in. With `resync` set, stops at the first line that already has
+// that state on record and returns -1. Returns the state after the last
+// line otherwise.
+int highlightLines(struct highlightJob *job, int from, int to, int in_comment, int resync) {
+  for (int l = from; l < to; l++) {
+    if ((l & 4095) == 0 && __atomic_load_n(&job -> cancel, __ATOMIC_RELAXED)) return 0;
+    if (resync && job -> states[l] == in_comment + 1) return -1;
+    job -> states[l] = in_comment + 1;
+    int len;
+    char *s = editorFileLine(l, &len);
+    in_comment = editorLex(job -> lx, s, len, NULL, in_comment);
+  }
+  return in_comment;
+}
+
+void highlightFixup(struct highlightJob *job) {
+  int in_comment = 0;
+  for (int c = 0; c < job -> nchunks; c++) {
+    int from = c * PICKLE_HL_CHUNK;
+    int to = from + PICKLE_HL_CHUNK < job -> lines ? from + PICKLE_HL_CHUNK : job -> lines;
+    if (in_comment == 0) {
+      in_comment = job -> exits[c];
+      continue;
+    }
+    in_comment = highlightLines(job, from, to, in_comment, 1);
+    if (in_comment < 0) in_comment = job -> exits[c];
+  }
+}
+
+void *highlightWorker(void *arg) {
+  struct highlightJob *job = (struct highlightJob*) arg;
+  int c;
+  while ((c = __sync_fetch_and_add(&job -> next, 1)) < job -> nchunks) {
+    int from = c * PICKLE_HL_CHUNK;
+    int to = from + PICKLE_HL_CHUNK < job -> lines ? from + PICKLE_HL_CHUNK : job -> lines;
+    job -> exits[c] = highlightLines(job, from, to, 0, 0);
+    if (__atomic_load_n(&job -> cancel, __ATOMIC_RELAXED)) break;
+    // Whoever finishes the last chunk does the fix-up.
+    if (__sync_add_and_fetch(&job -> finished, 1) == job -> nchunks) {
+      highlightFixup(job);
+      __atomic_store_n(&job -> done, 1, __ATOMIC_RELEASE);
+    }
+  }
+  return NULL;
+}
+
+void editorHighlightStart() {
+  editorHighlightStop();
+  if (P.syntax == NULL || P.maplines <= PICKLE_HL_CHUNK) return;
+
+  struct highlightJob *job = (struct highlightJob*) calloc(1, sizeof(struct highlightJob));
+  job -> lx = P.syntax -> lexer;
+  job -> lines = P.maplines;
+  job -> states = (unsigned char*) malloc(job -> lines);
+  job -> nchunks = (job -> lines + PICKLE_HL_CHUNK - 1) / PICKLE_HL_CHUNK;
+  job -> exits = (unsigned char*) malloc(job -> nchunks);
+
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  int nthreads = ncpu > 0 ? ncpu : 1;
+  if (nthreads > PICKLE_INDEX_THREADS) nthreads = PICKLE_INDEX_THREADS;
+  if (nthreads > job -> nchunks) nthreads = job -> nchunks;
+  for (int i = 0; i < nthreads; i++)
+    if (pthread_create(&job -> threads[job -> nthreads], NULL, highlightWorker, job) == 0)
+      job -> nthreads++;
+  if (job -> nthreads == 0) {
+    free(job -> states);
+    free(job -> exits);
+    free(job);
     return;
   }
-  P.row = (erow*) realloc(P.row, sizeof(erow) * (P.numrows + 1));
-  
-  memmove(&P.row[at + 1], &P.row[at], sizeof(erow) * (P.numrows - at));
-  for (int j = at + 1; j <= P.numrows; j++) P.row[j].idx++;
+  P.highlighter = job;
+}
+
+void highlightFree(struct highlightJob *job) {
+  for (int i = 0; i < job -> nthreads; i++) pthread_join(job -> threads[i], NULL);
+  free(job -> states);
+  free(job -> exits);
+  free(job);
+}
 
-  P.row[at].idx = at;
+void editorHighlightStop() {
+  struct highlightJob *job = P.highlighter;
+  if (job == NULL) return;
+  __atomic_store_n(&job -> cancel, 1, __ATOMIC_RELAXED);
+  highlightFree(job);
+  P.highlighter = NULL;
+}
 
-  P.row[at].size = len;
-  P.row[at].chars = (char*)malloc(len + 1);
-  memcpy(P.row[at].chars, s, len);
-  P.row[at].chars[len] = '\0';
+// Takes the lexer states of a finished job. Lines lexed in the meantime
+// keep what they have, since edits above them may have changed it.
+int editorHighlightPoll() {
+  struct highlightJob *job = P.highlighter;
+  if (job == NULL || !__atomic_load_n(&job -> done, __ATOMIC_ACQUIRE)) return 0;
+  for (int l = 0; l < job -> lines; l++)
+    if (P.linestate[l] == 0) P.linestate[l] = job -> states[l];
+  highlightFree(job);
+  P.highlighter = NULL;
+  return 0;
+}
 
-  P.row[at].rsize = 0;
-  P.row[at].render = NULL;
-  P.row[at].highlight = NULL;
-  P.row[at].hl_open_comment = 0;
-  editorUpdateRow(&P.row[at]);
+// A loaded row holding a copy of `s`, still waiting to be highlighted.
+rowNode *editorNewRow(const char *s, size_t len) {
+  rowNode *n = nodeNew(-1, 1);
+
+  erow *row = &n -> row;
+  row -> size = len;
+  row -> chars = storeAlloc(len + 1, &row -> charscap);
+  memcpy(row -> chars, s, len);
+  row -> chars[len] = '\0';
+  n -> dirty = 1;
+  nodeUpdate(n);
+  return n;
+}
 
-  P.numrows++;
+// Puts a tree of `count` new rows in front of line `at` with a single split.
+void editorSpliceRows(int at, rowNode *rows, int count) {
+  rowNode *l, *r;
+  docSplit(P.rows, at, &l, &r);
+  docSetRoot(docMerge(docMerge(l, rows), r));
+  if (P.indexer && at <= P.indexer -> filerow) P.indexer -> filerow += count;
   P.trash++;
 }
 
+void editorInsertRow(int at, const char *s, size_t len) {
+  if (at < 0 || at > P.numrows){
+    return;
+  }
+  journalRecord(JOURNAL_INSERT_ROW, at, 0, s, len);
+  undoRecord(UNDO_INSERT_ROW, at, 0, s, len);
+  editorSpliceRows(at, editorNewRow(s, len), 1);
+}
+
 void editorRowInsertChar(erow *row, int at, int c) {
   if (at < 0 || at > row -> size) at = row -> size;
-  row -> chars = (char*)realloc(row -> chars, row -> size + 2);
+  char ch = c;
+  int line = editorRowIndex(row);
+  journalRecord(JOURNAL_INSERT, line, at, &ch, 1);
+  undoRecord(UNDO_INSERT, line, at, &ch, 1);
+  editorRowOwnChars(row);
+  row -> chars = storeReserve(row -> chars, &row -> charscap, row -> size + 2, row -> size + 1);
   memmove(&row -> chars[at + 1], &row -> chars[at], row -> size - at + 1);
   row -> size++;
   row -> chars[at] = c;
-  editorUpdateRow(row);
+  editorRowEdited(row, at, 0, 1);
   P.trash++;
 }
 
 void editorRowDeleteChar(erow *row, int at) {
-  if (at < 0 || at > row -> size){
+  if (at < 0 || at >= row -> size){
     return;
   }
+  int line = editorRowIndex(row);
+  journalRecord(JOURNAL_DELETE, line, at, NULL, 1);
+  undoRecord(UNDO_DELETE, line, at, &row -> chars[at], 1);
+  editorRowOwnChars(row);
   memmove(&row -> chars[at], &row -> chars[at+1], row -> size - at);
   row -> size--;
-  editorUpdateRow(row);
+  editorRowEdited(row, at, 1, 0);
   P.trash++;
 }
 
 void editorRowAppendString(erow *row, char *s, size_t len) {
-  row -> chars = (char*) realloc(row ->chars, row -> size + len + 1);
+  int line = editorRowIndex(row);
+  journalRecord(JOURNAL_INSERT, line, row -> size, s, len);
+  undoRecord(UNDO_INSERT, line, row -> size, s, len);
+  editorRowOwnChars(row);
+  row -> chars = storeReserve(row -> chars, &row -> charscap, row -> size + len + 1, row -> size);
   memcpy(&row -> chars[row -> size], s, len);
   row -> size += len;
   row -> chars[row -> size] = '\0';
-  editorUpdateRow(row);
+  editorRowEdited(row, row -> size - len, 0, len);
   P.trash++;
 }
 
-void editorFreeRow(erow *row) {
-  free(row -> render);
-  free(row -> chars);
-  free(row -> highlight);
-}
-
 void editorDelRow(int at) {
   if (at < 0 || at >= P.numrows){
     return;
   }
-  editorFreeRow(&P.row[at]);
-  memmove(&P.row[at], &P.row[at + 1], sizeof(erow) * (P.numrows - at - 1));
-  for (int j = at; j < P.numrows - 1; j++) P.row[j].idx--;
-  P.numrows--;
+  erow *row = editorRowAt(at);
+  journalRecord(JOURNAL_DEL_ROW, at, 0, NULL, 0);
+  undoRecord(UNDO_DEL_ROW, at, 0, row -> chars, row -> size);
+  rowNode *next = nodeNext(ROW_NODE(row));
+  rowNode *l, *m, *r;
+  docSplit(P.rows, at, &l, &m);
+  docSplit(m, 1, &m, &r);
+  docSetRoot(docMerge(l, r));
+  if (P.indexer && at < P.indexer -> filerow) P.indexer -> filerow--;
+  if (next) nodeSetDirty(next, 1);
+
+  editorFreeRow(&m -> row);
+  storeFreeNode(m);
+  P.trash++;
+}
+
+// Deletes `len` bytes from line `at`, column `col` on, a line break counting
+// as one byte. The lines taken out whole go with a single split, so the cost
+// is that of the text deleted.
+void editorDeleteText(int at, int col, int len) {
+  if (at < 0 || at >= P.numrows || len <= 0) return;
+  erow *row = editorRowAt(at);
+  if (col > row -> size) col = row -> size;
+
+  // Walk to where the deletion ends, `lines` lines down at `endcol`,
+  // collecting what goes.
+  struct appendBuffer gone = APPENDBUFFER_INIT;
+  int lines = 0;
+  int endcol = col + len;
+  const char *tail = NULL;
+  int taillen = 0;
+  if (endcol <= row -> size) {
+    abAppend(&gone, &row -> chars[col], len);
+  } else {
+    abAppend(&gone, &row -> chars[col], row -> size - col);
+    int rest = len - (row -> size - col);
+    endcol = row -> size;
+    for (rowNode *n = nodeNext(ROW_NODE(row)); n && rest > 0; n = nodeNext(n))
+      for (int k = 0; k < n -> lines && rest > 0; k++) {
+        int size;
+        char *chars = editorNodeLine(n, k, &size);
+        abAppend(&gone, "\n", 1);
+        rest--;
+        lines++;
+        endcol = rest < size ? rest : size;
+        abAppend(&gone, chars, endcol);
+        rest -= endcol;
+        tail = &chars[endcol];
+        taillen = size - endcol;
+      }
+  }
+  if (gone.len == 0) {
+    abFree(&gone);
+    return;
+  }
+  journalRecord(JOURNAL_DELETE, at, col, NULL, gone.len);
+  undoRecord(UNDO_DELETE, at, col, gone.b, gone.len);
+  abFree(&gone);
+
+  editorRowOwnChars(row);
+  if (lines == 0) {
+    memmove(&row -> chars[col], &row -> chars[endcol], row -> size - endcol + 1);
+    row -> size -= endcol - col;
+    editorRowEdited(row, col, endcol - col, 0);
+  } else {
+    rowNode *l, *m, *r;
+    docSplit(P.rows, at + 1, &l, &m);
+    docSplit(m, lines, &m, &r);
+    row -> chars = storeReserve(row -> chars, &row -> charscap, col + taillen + 1, col);
+    memcpy(&row -> chars[col], tail, taillen);
+    row -> size = col + taillen;
+    row -> chars[row -> size] = '\0';
+    docFree(m);
+    docSetRoot(docMerge(l, r));
+    if (P.indexer && at + 1 < P.indexer -> filerow)
+      P.indexer -> filerow -= P.indexer -> filerow - (at + 1) < lines ? P.indexer -> filerow - (at + 1) : lines;
+    rowNode *next = nodeNext(ROW_NODE(row));
+    if (next) nodeSetDirty(next, 1);
+    editorUpdateRow(row);
+  }
   P.trash++;
 }
 
@@ -767,13 +4405,14 @@ void editorDelChar(){
   if(P.cx == 0 && P.cy == 0){
     return;
   }
-  erow *row = &P.row[P.cy];
+  erow *row = editorRowAt(P.cy);
   if (P.cx > 0) {
     editorRowDeleteChar(row, P.cx - 1);
     P.cx--;
   } else {
-    P.cx = P.row[P.cy -1].size;
-    editorRowAppendString(&P.row[P.cy - 1], row -> chars, row -> size);
+    erow *prev = editorRowPrev(row);
+    P.cx = prev -> size;
+    editorRowAppendString(prev, row -> chars, row -> size);
     editorDelRow(P.cy);
     P.cy--;
   }
@@ -785,40 +4424,603 @@ void editorInsertChar(int c){
   if (P.cy == P.numrows) {
     editorInsertRow(P.numrows, "",0);
   }
-  editorRowInsertChar(&P.row[P.cy], P.cx, c);
+  editorRowInsertChar(editorRowAt(P.cy), P.cx, c);
   P.cx++;
 }
 
+// Inserts a block of text at the cursor in one go. Lines are separated by
+// '\n'; the current row is cut once, every other line becomes a new row, and
+// they all go into the document together, so each line is highlighted once.
+void editorInsertText(const char *s, int len) {
+  if (len == 0) return;
+  if (P.cy == P.numrows) {
+    editorInsertRow(P.numrows, "", 0);
+  }
+  journalRecord(JOURNAL_INSERT, P.cy, P.cx, s, len);
+  undoRecord(UNDO_INSERT, P.cy, P.cx, s, len);
+  erow *row = editorRowAt(P.cy);
+  editorRowOwnChars(row);
+  const char *end = s + len;
+  const char *nl = (const char*)memchr(s, '\n', len);
+
+  if (!nl) {
+    row -> chars = storeReserve(row -> chars, &row -> charscap, row -> size + len + 1, row -> size + 1);
+    memmove(&row -> chars[P.cx + len], &row -> chars[P.cx], row -> size - P.cx + 1);
+    memcpy(&row -> chars[P.cx], s, len);
+    row -> size += len;
+    editorRowEdited(row, P.cx, 0, len);
+    P.cx += len;
+    P.trash++;
+    return;
+  }
+
+  rowNode *added = NULL;
+  int count = 0;
+  const char *line = nl + 1;
+  const char *next;
+  while ((next = (const char*)memchr(line, '\n', end - line)) != NULL) {
+    added = docMerge(added, editorNewRow(line, next - line));
+    count++;
+    line = next + 1;
+  }
+
+  // Whatever followed the cursor ends up after the last pasted line.
+  int lastlen = end - line;
+  int tail = row -> size - P.cx;
+  rowNode *last = editorNewRow(line, lastlen);
+  last -> row.chars = storeReserve(last -> row.chars, &last -> row.charscap, lastlen + tail + 1, lastlen);
+  memcpy(&last -> row.chars[lastlen], &row -> chars[P.cx], tail + 1);
+  last -> row.size = lastlen + tail;
+  added = docMerge(added, last);
+  count++;
+
+  row -> chars = storeReserve(row -> chars, &row -> charscap, P.cx + (nl - s) + 1, P.cx);
+  memcpy(&row -> chars[P.cx], s, nl - s);
+  row -> size = P.cx + (nl - s);
+  row -> chars[row -> size] = '\0';
+  editorUpdateRow(row);
+
+  editorSpliceRows(P.cy + 1, added, count);
+  P.cy += count;
+  P.cx = lastlen;
+}
+
+// Reads a bracketed paste up to its closing marker and inserts it as one
+// block. Terminals send newlines in a paste as '\r', so "\r", "\n" and
+// "\r\n" all end a line.
+void editorPaste() {
+  static const char marker[] = "\x1b[201~";
+  struct appendBuffer text = APPENDBUFFER_INIT;
+  int matched = 0;
+  int cr = 0;
+  char c;
+
+  while (inputGet(&c, PICKLE_PASTE_TIMEOUT)) {
+    if (c == marker[matched]) {
+      if (++matched == (int) sizeof(marker) - 1) break;
+      continue;
+    }
+    if (matched) {
+      abAppend(&text, marker, matched);
+      matched = (c == marker[0]);
+      cr = 0;
+      if (matched) continue;
+    }
+    if (c == '\n' && cr) {
+      cr = 0;
+      continue;
+    }
+    cr = (c == '\r');
+    if (cr) c = '\n';
+    abAppend(&text, &c, 1);
+  }
+  editorInsertText(text.b, text.len);
+  abFree(&text);
+}
+
 void editorInsertNewline() {
   if (P.cx == 0) {
     editorInsertRow(P.cy, "", 0);
   } else {
-    erow *row = &P.row[P.cy];
+    erow *row = editorRowAt(P.cy);
     editorInsertRow(P.cy + 1, &row->chars[P.cx], row -> size - P.cx);
-    row = &P.row[P.cy];
+    journalRecord(JOURNAL_TRUNCATE, P.cy, P.cx, NULL, 0);
+    undoRecord(UNDO_DELETE, P.cy, P.cx, &row -> chars[P.cx], row -> size - P.cx);
+    editorRowOwnChars(row);
+    editorRowEdited(row, P.cx, row -> size - P.cx, 0);
     row -> size = P.cx;
     row -> chars[row -> size] = '\0';
-    editorUpdateRow(row);
   }
   P.cy++;
   P.cx = 0;
 }
 
-char *editorRowsToString(int *buflen) {
-  int len = 0;
-  int i;
-  for (i = 0; i < P.numrows; i++)
-    len += P.row[i].size + 1;
-  *buflen = len;
-  char *buff = (char*) malloc(len);
-  char *p = buff;
-  for (i = 0; i < P.numrows; i++) {
-    memcpy(p, P.row[i].chars, P.row[i].size);
-    p += P.row[i].size;
-    *p = '\n';
-    p++;
+// Reports how much memory the document takes on top of the file mapping.
+void editorShowMemory() {
+  struct rowStore *s = &P.store;
+  int loaded = 0;
+  for (rowNode *n = P.rows ? nodeFirst(P.rows) : NULL; n; n = nodeNext(n))
+    if (n -> fileline < 0) loaded++;
+  size_t lines = (size_t) P.maplines * (sizeof(unsigned int) + (P.linestate ? 1 : 0));
+  editorSetStatusMessage("Memory: %d rows %.1f MB, slabs %.1f MB, %ld nodes, lines %.1f MB, undo %.1f MB",
+                         loaded, (s -> inuse + s -> large) / 1048576.0, s -> slabbytes / 1048576.0,
+                         s -> nodes, lines / 1048576.0, P.undo -> len / 1048576.0);
+}
+
+// Applies the record at `off`, or its opposite when `undo` is set, and
+// leaves the cursor where it happened.
+void undoApply(size_t off, int undo) {
+  undoRecordHeader h;
+  memcpy(&h, P.undo -> b + off, sizeof(h));
+  const char *text = P.undo -> b + off + sizeof(h);
+  int op = h.op;
+  if (undo) {
+    if (op == UNDO_INSERT) op = UNDO_DELETE;
+    else if (op == UNDO_DELETE) op = UNDO_INSERT;
+    else if (op == UNDO_INSERT_ROW) op = UNDO_DEL_ROW;
+    else op = UNDO_INSERT_ROW;
+  }
+  P.cy = h.line;
+  P.cx = h.col;
+  switch (op) {
+    case UNDO_INSERT:
+      editorInsertText(text, h.len);
+      if (undo) {
+        P.cy = h.line;
+        P.cx = h.col;
+      }
+      break;
+    case UNDO_DELETE:
+      editorDeleteText(h.line, h.col, h.len);
+      break;
+    case UNDO_INSERT_ROW:
+      editorInsertRow(h.line, text, h.len);
+      break;
+    case UNDO_DEL_ROW:
+      editorDelRow(h.line);
+      if (P.cy >= P.numrows && P.cy > 0) P.cy--;
+      break;
+  }
+}
+
+void editorUndo() {
+  struct undoLog *u = P.undo;
+  if (u -> pos == 0) {
+    editorSetStatusMessage("Nothing to undo");
+    return;
+  }
+  u -> applying = 1;
+  while (u -> pos > 0) {
+    unsigned int size;
+    memcpy(&size, u -> b + u -> pos - sizeof(size), sizeof(size));
+    u -> pos -= size;
+    undoApply(u -> pos, 1);
+    if (((undoRecordHeader*) (u -> b + u -> pos)) -> group) break;
+  }
+  u -> applying = 0;
+  u -> mergeable = 0;
+}
+
+void editorRedo() {
+  struct undoLog *u = P.undo;
+  if (u -> pos == u -> len) {
+    editorSetStatusMessage("Nothing to redo");
+    return;
+  }
+  u -> applying = 1;
+  do {
+    undoApply(u -> pos, 0);
+    u -> pos += undoRecordSize(((undoRecordHeader*) (u -> b + u -> pos)) -> len);
+  } while (u -> pos < u -> len && !((undoRecordHeader*) (u -> b + u -> pos)) -> group);
+  u -> applying = 0;
+  u -> mergeable = 0;
+}
+
+// Maps `filename` read-only and makes it the document. Rows only start
+// owning memory once they are edited.
+int editorMapFile(const char *filename) {
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1) return -1;
+
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    close(fd);
+    return -1;
+  }
+  char *map = NULL;
+  if (st.st_size > 0) {
+    map = (char*) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+      close(fd);
+      return -1;
+    }
+  }
+  close(fd);
+  editorLoadText(map, st.st_size, 0);
+  editorTrigramStart(filename, &st);
+  return 0;
+}
+
+// A save runs on a writer thread over a snapshot of the document taken when
+// it starts, so editing goes on while the file is written. Runs of
+// untouched lines, and loaded rows still borrowing their line from the
+// mapping, are kept as references into it, which stays put until the save
+// is over. Only rows with chars of their own are copied.
+typedef struct savePiece {
+  int fileline;
+  int lines;
+  size_t off, len;
+} savePiece;
+
+struct saveJob {
+  char *filename;
+  savePiece *pieces;
+  int npieces, cap;
+  struct appendBuffer copy;
+  size_t size;
+  size_t written;
+  size_t journalmark;
+  struct stat st;
+  int err;
+  int done;
+  int threaded;
+  pthread_t thread;
+  struct timespec start;
+};
+
+// Rows are written straight from the snapshot, a batch of iovecs at a
+// time. Lines still in the mapping come with their own newline, so a run of
+// untouched lines ends up as a single iovec.
+typedef struct saveBatch {
+  struct saveJob *job;
+  int fd;
+  struct iovec iov[PICKLE_SAVE_IOV];
+  int n;
+  size_t pending;
+} saveBatch;
+
+int saveFlush(saveBatch *b) {
+  struct iovec *iov = b -> iov;
+  int n = b -> n;
+  b -> n = 0;
+  b -> pending = 0;
+  while (n > 0) {
+    ssize_t w = writev(b -> fd, iov, n);
+    if (w == -1) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    __atomic_add_fetch(&b -> job -> written, w, __ATOMIC_RELAXED);
+    while (n > 0 && (size_t) w >= iov -> iov_len) {
+      w -= iov -> iov_len;
+      iov++;
+      n--;
+    }
+    if (n > 0) {
+      iov -> iov_base = (char*) iov -> iov_base + w;
+      iov -> iov_len -= w;
+    }
+  }
+  return 0;
+}
+
+// Batches are also flushed every PICKLE_SAVE_CHUNK bytes, which keeps the
+// progress shown moving.
+int saveAppend(saveBatch *b, const char *s, size_t len) {
+  if (len == 0) return 0;
+  b -> pending += len;
+  if (b -> n > 0) {
+    struct iovec *last = &b -> iov[b -> n - 1];
+    if ((const char*) last -> iov_base + last -> iov_len == s) {
+      last -> iov_len += len;
+      return b -> pending >= PICKLE_SAVE_CHUNK ? saveFlush(b) : 0;
+    }
+  }
+  if (b -> n == PICKLE_SAVE_IOV && saveFlush(b) == -1) return -1;
+  b -> iov[b -> n].iov_base = (void*) s;
+  b -> iov[b -> n].iov_len = len;
+  b -> n++;
+  return b -> pending >= PICKLE_SAVE_CHUNK ? saveFlush(b) : 0;
+}
+
+int saveWrite(struct saveJob *job, int fd) {
+  static const char newline = '\n';
+  saveBatch *b = (saveBatch*) malloc(sizeof(saveBatch));
+  b -> job = job;
+  b -> fd = fd;
+  b -> n = 0;
+  b -> pending = 0;
+  int ok = 1;
+  for (int i = 0; i < job -> npieces && ok; i++) {
+    savePiece *p = &job -> pieces[i];
+    if (p -> fileline < 0) {
+      ok = saveAppend(b, job -> copy.b + p -> off, p -> len) == 0;
+      continue;
+    }
+    for (int k = 0; k < p -> lines && ok; k++) {
+      int size;
+      char *chars = editorFileLine(p -> fileline + k, &size);
+      const char *nl = &newline;
+      if (chars + size < P.map + P.mapsize && chars[size] == '\n') nl = &chars[size];
+      ok = saveAppend(b, chars, size) == 0 && saveAppend(b, nl, 1) == 0;
+    }
+  }
+  if (ok) ok = saveFlush(b) == 0;
+  free(b);
+  return ok ? 0 : -1;
+}
+
+// Writes the snapshot to a temporary file next to the real one, which is
+// only replaced once it is safely on disk, so a failed save leaves the old
+// file whole. A symlink is followed so that it keeps pointing at the file.
+// Returns 0, or the errno of what went wrong.
+int saveToFile(struct saveJob *job) {
+  char *path = realpath(job -> filename, NULL);
+  if (path == NULL) path = strdup(job -> filename);
+  struct stat st;
+  int exists = stat(path, &st) == 0;
+  mode_t mode;
+  if (exists) {
+    mode = st.st_mode & 07777;
+  } else {
+    mode_t mask = umask(0);
+    umask(mask);
+    mode = 0666 & ~mask;
+  }
+  const char *slash = strrchr(path, '/');
+  int dirlen = slash ? slash - path + 1 : 0;
+  char *tmp = (char*) malloc(strlen(path) + 32);
+  sprintf(tmp, "%.*s.%s.pickle-XXXXXX", dirlen, path, path + dirlen);
+
+  int fd = mkstemp(tmp);
+  int ok = fd != -1;
+  if (ok) {
+    // Keeping the owner only works for root, otherwise the file is ours.
+    if (exists) fchown(fd, st.st_uid, st.st_gid);
+    ok = saveWrite(job, fd) == 0 && fchmod(fd, mode) == 0 && fsync(fd) == 0;
+  }
+  int err = errno;
+  if (fd != -1 && close(fd) == -1 && ok) {
+    ok = 0;
+    err = errno;
+  }
+  if (ok && rename(tmp, path) == -1) {
+    ok = 0;
+    err = errno;
+  }
+  if (ok) {
+    // Make the rename itself durable.
+    char *dir = dirlen ? strndup(path, dirlen) : strdup(".");
+    int dirfd = open(dir, O_RDONLY);
+    if (dirfd != -1) {
+      fsync(dirfd);
+      close(dirfd);
+    }
+    free(dir);
+    stat(path, &job -> st);
+  } else if (fd != -1) {
+    unlink(tmp);
+  }
+  free(tmp);
+  free(path);
+  return ok ? 0 : err;
+}
+
+void *saveWorker(void *arg) {
+  struct saveJob *job = (struct saveJob*) arg;
+  job -> err = saveToFile(job);
+  __atomic_store_n(&job -> done, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+savePiece *saveAddPiece(struct saveJob *job) {
+  if (job -> npieces == job -> cap) {
+    job -> cap = job -> cap ? job -> cap * 2 : 64;
+    job -> pieces = (savePiece*) realloc(job -> pieces, sizeof(savePiece) * job -> cap);
+  }
+  savePiece *p = &job -> pieces[job -> npieces++];
+  memset(p, 0, sizeof(savePiece));
+  return p;
+}
+
+// Takes the snapshot and starts writing it out.
+void editorSaveStart() {
+  struct saveJob *job = (struct saveJob*) calloc(1, sizeof(struct saveJob));
+  job -> filename = strdup(P.filename);
+  for (rowNode *n = P.rows ? nodeFirst(P.rows) : NULL; n; n = nodeNext(n)) {
+    savePiece *last = job -> npieces ? &job -> pieces[job -> npieces - 1] : NULL;
+    int fileline = n -> fileline;
+    if (fileline < 0 && n -> row.mapped) fileline = editorMapLine(n -> row.chars - P.map);
+    if (fileline >= 0) {
+      if (last && last -> fileline >= 0 && last -> fileline + last -> lines == fileline) {
+        last -> lines += n -> lines;
+      } else {
+        last = saveAddPiece(job);
+        last -> fileline = fileline;
+        last -> lines = n -> lines;
+      }
+      job -> size += editorLineOffset(fileline + n -> lines) - editorLineOffset(fileline);
+    } else {
+      if (last == NULL || last -> fileline >= 0) {
+        last = saveAddPiece(job);
+        last -> fileline = -1;
+        last -> off = job -> copy.len;
+      }
+      abAppend(&job -> copy, n -> row.chars, n -> row.size);
+      abAppend(&job -> copy, "\n", 1);
+      last -> len += n -> row.size + 1;
+      job -> size += n -> row.size + 1;
+    }
+  }
+  if (P.journal) {
+    pthread_mutex_lock(&P.journal -> lock);
+    job -> journalmark = P.journal -> length;
+    pthread_mutex_unlock(&P.journal -> lock);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &job -> start);
+  P.save = job;
+  P.trash = 0;
+  editorSetStatusMessage("Saving...");
+
+  if (pthread_create(&job -> thread, NULL, saveWorker, job) == 0) job -> threaded = 1;
+  else saveWorker(job);
+}
+
+// Waits for the writer and reports how the save went. Unless `reload` is
+// off, the document is then read back from the new file if nothing was
+// edited meanwhile, so that edited rows go back to being untouched lines.
+// Otherwise it carries on from the old mapping, which is still valid.
+void editorSaveFinish(int reload) {
+  struct saveJob *job = P.save;
+  P.save = NULL;
+  if (job -> threaded) pthread_join(job -> thread, NULL);
+
+  if (job -> err) {
+    P.trash++;
+    editorSetStatusMessage("Can't save file. Error: %s", strerror(job -> err));
+  } else {
+    journalRebase(job -> filename, &job -> st, job -> journalmark);
+    if (reload && !P.trash && strcmp(job -> filename, P.filename) == 0) {
+      editorMapFile(P.filename);
+      if (P.cy > P.numrows) P.cy = P.numrows;
+    }
+    editorSetStatusMessage("%ld bytes written to disk", (long) job -> written);
+  }
+  free(job -> filename);
+  free(job -> pieces);
+  abFree(&job -> copy);
+  free(job);
+}
+
+void editorSaveWait() {
+  if (P.save) editorSaveFinish(0);
+}
+
+// Shows how far the save has got, or how it went once it is over. Returns 1
+// if the status message changed.
+int editorSavePoll() {
+  struct saveJob *job = P.save;
+  if (job == NULL) return 0;
+  if (__atomic_load_n(&job -> done, __ATOMIC_ACQUIRE)) {
+    editorSaveFinish(1);
+    return 1;
+  }
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double secs = (now.tv_sec - job -> start.tv_sec) + (now.tv_nsec - job -> start.tv_nsec) / 1e9;
+  double mb = __atomic_load_n(&job -> written, __ATOMIC_RELAXED) / 1048576.0;
+  int percent = job -> size ? mb * 1048576.0 * 100 / job -> size : 0;
+  if (percent > 99) percent = 99;
+  editorSetStatusMessage("Saving... %d%% (%.1f MB, %.1f MB/s)", percent, mb, secs > 0 ? mb / secs : 0);
+  return 1;
+}
+
+// Replays one journal record. Returns 0 if it does not fit the document,
+// which means the journal is damaged past this point.
+int journalApply(journalRecordHeader *rec, const char *text) {
+  if (rec -> op == JOURNAL_INSERT_ROW) {
+    if (rec -> line < 0 || rec -> line > P.numrows) return 0;
+    editorInsertRow(rec -> line, text, rec -> len);
+    P.cy = rec -> line;
+    P.cx = 0;
+    return 1;
+  }
+  if (rec -> line < 0 || rec -> line >= P.numrows) return 0;
+  erow *row = editorRowAt(rec -> line);
+  if (rec -> col < 0 || rec -> col > row -> size) return 0;
+  P.cy = rec -> line;
+  P.cx = rec -> col;
+  switch (rec -> op) {
+    case JOURNAL_INSERT:
+      editorInsertText(text, rec -> len);
+      break;
+    case JOURNAL_DELETE:
+      if (rec -> len < 0) return 0;
+      editorDeleteText(rec -> line, rec -> col, rec -> len);
+      break;
+    case JOURNAL_TRUNCATE:
+      editorRowOwnChars(row);
+      row -> size = rec -> col;
+      row -> chars[row -> size] = '\0';
+      editorUpdateRow(row);
+      P.trash++;
+      break;
+    case JOURNAL_DEL_ROW:
+      editorDelRow(rec -> line);
+      P.cx = 0;
+      break;
+    default:
+      return 0;
+  }
+  return 1;
+}
+
+// Looks for a journal left behind by a session on `filename` and offers to
+// replay it. Journaling then goes on in the same journal, or in a new one.
+void editorJournalRecover(const char *filename, struct stat *st) {
+  journalStart(filename, st, -1, 0);
+  struct journal *j = P.journal;
+  int fd = open(j -> path, O_RDWR);
+  if (fd == -1) return;
+
+  struct stat jst;
+  journalHeader header;
+  char *data = NULL;
+  size_t len = 0;
+  if (fstat(fd, &jst) == 0 && jst.st_size > (off_t) sizeof(header) &&
+      read(fd, &header, sizeof(header)) == sizeof(header) &&
+      memcmp(header.magic, j -> header.magic, sizeof(header)) == 0) {
+    len = jst.st_size - sizeof(header);
+    data = (char*) malloc(len);
+    if (pread(fd, data, len, sizeof(header)) != (ssize_t) len) len = 0;
+  } else if (jst.st_size > (off_t) sizeof(header)) {
+    editorSetStatusMessage("Ignoring a journal left for another version of the file");
+  }
+  if (len == 0) {
+    free(data);
+    close(fd);
+    return;
+  }
+
+  editorSetStatusMessage("Unsaved changes to this file were found. Recover them? (y/n)");
+  editorRefreshScreen();
+  int c = editorReadKey();
+  if (c != 'y' && c != 'Y') {
+    free(data);
+    close(fd);
+    unlink(j -> path);
+    editorSetStatusMessage("");
+    return;
+  }
+
+  // The records are applied with journaling off, and the journal is cut
+  // back to the last one that made sense before new ones are appended.
+  editorIndexWait();
+  P.journal = NULL;
+  size_t pos = 0;
+  int count = 0;
+  while (pos + sizeof(journalRecordHeader) <= len) {
+    journalRecordHeader rec;
+    memcpy(&rec, data + pos, sizeof(rec));
+    int textlen = (rec.op == JOURNAL_INSERT || rec.op == JOURNAL_INSERT_ROW) ? rec.len : 0;
+    if (textlen < 0 || pos + sizeof(rec) + textlen > len) break;
+    if (!journalApply(&rec, data + pos + sizeof(rec))) break;
+    pos += sizeof(rec) + textlen;
+    count++;
+  }
+  P.journal = j;
+  free(data);
+
+  journalHalt(j);
+  if (ftruncate(fd, sizeof(header) + pos) == 0 && lseek(fd, 0, SEEK_END) != -1) {
+    j -> fd = fd;
+    j -> length = pos;
+  } else {
+    close(fd);
   }
-  return buff;
+  journalRun(j);
+  editorScroll();
+  editorSetStatusMessage("Recovered %d changes", count);
 }
 
 void editorOpen(char *filename) {
@@ -827,25 +5029,13 @@ void editorOpen(char *filename) {
  
   editorSelectSyntaxHighlight();
 
-
-  FILE *fp = fopen(filename, "r");
-  if (!fp) {
-    die("fopen");
-  }
-
-  char *line = NULL;
-  size_t linecap = 0;
-  ssize_t linelen;
-  while((linelen = getline(&line, &linecap, fp)) != -1)
-  if (linelen != -1){
-    while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen -1] == '\r')){
-      linelen--;
-    }
-    editorInsertRow(P.numrows,line, linelen);
+  if (editorMapFile(filename) == -1) {
+    die("open");
   }
-  free(line);
-  fclose(fp);
   P.trash = 0;
+
+  struct stat st;
+  if (stat(filename, &st) == 0) editorJournalRecover(filename, &st);
 }
 
 void saveFile() {
@@ -858,89 +5048,221 @@ void saveFile() {
     editorSelectSyntaxHighlight();
   }
 
-  int lenght;
-  char *buff = editorRowsToString(&lenght);
+  if (P.indexer) {
+    editorSetStatusMessage("Waiting for the file to finish loading...");
+    editorRefreshScreen();
+    editorIndexWait();
+  }
 
-  int filed = open(P.filename, O_RDWR | O_CREAT, 0644);
-  if (filed != -1) {
-    if (ftruncate(filed, lenght) != -1){
-      if (write(filed, buff, lenght) == lenght) {
-        close(filed);
-        free(buff);
-        P.trash = 0;
-        editorSetStatusMessage("%d bytes written to disk", lenght);
-        return;
-      }
-    }
-    close(filed);
+  if (P.save) {
+    editorSetStatusMessage("Still saving, try again once it is done");
+    return;
   }
-  free(buff);
-  editorSetStatusMessage("Can't save file. Error: %s", strerror(errno));
+  editorSaveStart();
 }
 
+// Puts back the highlighting that the shown match painted over.
+void editorSearchUnmark(struct searchJob *job) {
+  job -> marked = NULL;
+}
 
-void editorFindCallback(const char *query, int key) {
-  static int last_found  = -1;
-  static int direction = 1;
+// Drops the search match shown on `row`, which is being highlighted again or
+// freed.
+void editorSearchForget(erow *row) {
+  if (P.search && P.search -> marked == row) P.search -> marked = NULL;
+}
 
-  static int saved_hl_line;
-  static char *saved_hl = NULL;
-  if (saved_hl) {
-    memcpy(P.row[saved_hl_line].highlight, saved_hl, P.row[saved_hl_line].rsize);
-    free(saved_hl);
-    saved_hl = NULL;
-  }
+// Moves the cursor to match `idx` and highlights it.
+void editorSearchShow(int idx) {
+  struct searchJob *job = P.search;
+  editorSearchUnmark(job);
+
+  pthread_mutex_lock(&job -> lock);
+  searchMatch match = job -> matches[idx];
+  pthread_mutex_unlock(&job -> lock);
+  job -> current = idx;
+
+  erow *row = editorRowAt(match.line);
+  editorRowRender(row);
+  P.cy = match.line;
+  P.cx = match.col;
+  P.rowoff = P.numrows;
+
+  // The match is painted over the row's highlighting when it is drawn, until
+  // the row is highlighted again.
+  job -> mark = match;
+  job -> marked = row;
+}
 
+void editorSearchFree(struct searchJob *job) {
+  editorSearchUnmark(job);
+  __atomic_store_n(&job -> cancel, 1, __ATOMIC_RELAXED);
+  if (job -> threaded) pthread_join(job -> thread, NULL);
+  pthread_mutex_destroy(&job -> lock);
+  free(job -> query);
+  free(job -> segs);
+  free(job -> matches);
+  free(job -> cands);
+  free(job -> starts);
+  rxFree(job -> rx);
+  free(job);
+}
 
-  if (key == '\r' || key == '\x1b') {
-    last_found = -1;
-    direction = 1;
-    return;
-  } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
-    direction = 1;
-  } else if (key == ARROW_LEFT || key == ARROW_UP) {
-    direction = -1;
+void editorSearchStop() {
+  if (P.search == NULL) return;
+  editorSearchFree(P.search);
+  P.search = NULL;
+}
+
+// Stops the search and returns a copy of its query, or NULL if there was
+// none.
+char *editorSearchTake() {
+  if (P.search == NULL) return NULL;
+  char *query = strdup(P.search -> query);
+  editorSearchStop();
+  return query;
+}
+
+// Picks the regex literal to skip ahead with: the one that turns up least
+// often in the start of the file, or the longest on a tie.
+void searchPickLiteral(struct searchJob *job) {
+  rxProgram *rx = job -> rx;
+  size_t sample = P.mapsize < PICKLE_SEARCH_SAMPLE ? P.mapsize : PICKLE_SEARCH_SAMPLE;
+  int best = -1, bestcount = 0;
+  for (int i = 0; i < rx -> nlits; i++) {
+    int count = 0;
+    const char *s = P.map, *end = P.map + sample;
+    while (s && s < end) {
+      s = (const char*) memmem(s, end - s, rx -> lit[i], rx -> litlen[i]);
+      if (s) {
+        count++;
+        s++;
+      }
+    }
+    if (best < 0 || count < bestcount || (count == bestcount && rx -> litlen[i] > rx -> litlen[best])) {
+      best = i;
+      bestcount = count;
+    }
+  }
+  if (best >= 0) {
+    job -> needle = rx -> lit[best];
+    job -> nlen = rx -> litlen[best];
   } else {
-    last_found = -1;
-    direction = 1;
+    job -> nlen = 0;
+  }
+}
+
+void editorSearchStart(const char *query) {
+  struct searchJob *prev = P.search;
+  P.search = NULL;
+  if (query[0] == '\0') {
+    if (prev) editorSearchFree(prev);
+    return;
+  }
+  editorIndexWait();
+
+  struct searchJob *job = (struct searchJob*) calloc(1, sizeof(struct searchJob));
+  job -> query = strdup(query);
+  job -> qlen = strlen(query);
+  job -> needle = job -> query;
+  job -> nlen = job -> qlen;
+  job -> current = -1;
+  job -> drawn = -1;
+  pthread_mutex_init(&job -> lock, NULL);
+
+  if (P.searchregex) {
+    job -> rx = rxCompilePattern(query, &job -> error);
+    if (job -> rx == NULL) {
+      if (prev) editorSearchFree(prev);
+      job -> done = 1;
+      P.search = job;
+      return;
+    }
+    searchPickLiteral(job);
   }
+  for (int c = 0; c < 256; c++) job -> skip[c] = job -> nlen;
+  for (int i = 0; i < job -> nlen - 1; i++)
+    job -> skip[(unsigned char) job -> needle[i]] = job -> nlen - 1 - i;
+
+  trigramIndex *tri = P.trigram;
+  if (tri && __atomic_load_n(&tri -> ready, __ATOMIC_ACQUIRE) && job -> nlen >= 3) {
+    const unsigned char *q = (const unsigned char*) job -> needle;
+    job -> tri = tri;
+    for (int i = 0; i + 3 <= job -> nlen && job -> ntris < PICKLE_TRIGRAM_OVERLAP; i++)
+      job -> tris[job -> ntris++] = trigramHash((q[i] << 16) | (q[i + 1] << 8) | q[i + 2]);
+  }
+
+  // Narrow down the previous matches when the query was only extended and
+  // the previous scan got to the end, otherwise scan everything again.
+  if (prev && !prev -> rx && !job -> rx && __atomic_load_n(&prev -> done, __ATOMIC_ACQUIRE) &&
+      job -> qlen > prev -> qlen && strncmp(query, prev -> query, prev -> qlen) == 0) {
+    job -> narrow = 1;
+    job -> segs = prev -> segs;
+    job -> nsegs = prev -> nsegs;
+    job -> segcap = prev -> segcap;
+    job -> cands = prev -> matches;
+    job -> ncands = prev -> nmatches;
+    job -> candfirst = prev -> current > 0 ? prev -> current : 0;
+    prev -> segs = NULL;
+    prev -> matches = NULL;
+  }
+  if (prev) editorSearchFree(prev);
+  if (!job -> narrow) searchSnapshot(job, P.cy);
+  P.search = job;
 
+  if (pthread_create(&job -> thread, NULL, searchWorker, job) == 0) job -> threaded = 1;
+  else searchWorker(job);
+}
 
-  if (last_found == -1) {
-    direction = 1;
+// Shows the first match once the worker has found one. Returns 1 if the
+// screen needs redrawing, which is also the case whenever the match count
+// shown in the prompt is out of date.
+int editorSearchPoll() {
+  struct searchJob *job = P.search;
+  if (job == NULL) return 0;
+  int done = __atomic_load_n(&job -> done, __ATOMIC_ACQUIRE);
+  pthread_mutex_lock(&job -> lock);
+  int found = job -> nmatches;
+  pthread_mutex_unlock(&job -> lock);
+  if (job -> current < 0 && found) {
+    editorSearchShow(0);
+    return 1;
   }
+  return found != job -> drawn || done != job -> drawndone;
+}
 
-  int actual = last_found;
-  int i;
-  for (i = 0; i < P.numrows; i++){
-    if (direction > 0) {
-      actual++;
-    } else {
-      actual--;
-    }
+void editorFindCallback(const char *query, int key) {
+  if (key == '\r' || key == '\x1b') {
+    editorSearchStop();
+    return;
+  }
 
-    if (actual == -1) {
-      actual = P.numrows - 1;
-    } else if (actual == P.numrows){
-      actual = 0;
-    }
+  struct searchJob *job = P.search;
+  if (key == ARROW_RIGHT || key == ARROW_DOWN || key == ARROW_LEFT || key == ARROW_UP) {
+    if (job == NULL || job -> current < 0) return;
+    pthread_mutex_lock(&job -> lock);
+    int found = job -> nmatches;
+    pthread_mutex_unlock(&job -> lock);
+    int done = __atomic_load_n(&job -> done, __ATOMIC_ACQUIRE);
+
+    // Matches are kept in order from where the search started, wrapping
+    // around, so stepping is just moving through the list. Until the scan is
+    // finished the list has no end to wrap to.
+    int next = job -> current + ((key == ARROW_RIGHT || key == ARROW_DOWN) ? 1 : -1);
+    if (next >= found) next = done ? 0 : found - 1;
+    if (next < 0) next = done ? found - 1 : 0;
+    editorSearchShow(next);
+    return;
+  }
 
-    erow *row = &P.row[i];
-    char *match = strstr(row -> render, query);
-  
-    if (match) {
-      last_found = actual;
-      P.cy = actual;
-      P.cx = editorRowRxToCx(row, match - row -> render);
-      P.rowoff = P.numrows;
-
-      saved_hl_line = actual;
-      saved_hl = (char*) malloc(row->rsize);
-      memcpy(saved_hl, row -> highlight, row -> rsize);
-      memset(&row -> highlight[match - row -> render], HL_MATCH, strlen(query));
-      break;
-    }
+  if (key == CTRL_KEY('r')) {
+    P.searchregex = !P.searchregex;
+    editorSearchStop();
+    job = NULL;
   }
+  if (job && strcmp(job -> query, query) == 0) return;
+  editorSearchStart(query);
+  editorSearchPoll();
 }
 
 void editorFind() {
@@ -950,7 +5272,7 @@ void editorFind() {
   int coloff_buffer = P.coloff;
   int rowoff_buffer = P.rowoff;
 
-  char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)", editorFindCallback);
+  char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter, Ctrl-R: regex)", editorFindCallback);
   if (query){
     free(query);
   } else {
@@ -965,16 +5287,23 @@ void editorFind() {
 void editorProcessKeypress() {
   static int quit_times = PICKLE_QUIT_TIMES;
   int c = editorReadKey();
+  undoBoundary(c == BACKSPACE || c == CTRL_KEY('h') || c == DEL_KEY || c == '\t' || (c >= 32 && c < 127));
   switch (c) {
     case '\r':
       editorInsertNewline();
       break;
     case CTRL_KEY('q'):
+      if (P.save) {
+        editorSetStatusMessage("Waiting for the save to finish...");
+        editorRefreshScreen();
+        editorSaveWait();
+      }
       if(P.trash && quit_times > 0){
         editorSetStatusMessage("Warning! File has unsaved changes -- Press Ctrl+Q %d more times to Quit", quit_times);
         quit_times--;
         return;
       }
+      journalDiscard();
       write(STDOUT_FILENO, "\x1b[2J", 4);
       write(STDOUT_FILENO, "\x1b[H", 3);
       exit(0);
@@ -987,13 +5316,28 @@ void editorProcessKeypress() {
       break;
     case END_KEY:
       if (P.cy < P.numrows){
-        P.cx = P.row[P.cy].size;
+        P.cx = editorRowAt(P.cy) -> size;
       }
       break;
 
     case CTRL_KEY('f'):
       editorFind();
       break;
+
+    case CTRL_KEY('g'):
+      editorShowMemory();
+      break;
+
+    case CTRL_KEY('t'):
+      editorTrigramBuild();
+      break;
+
+    case CTRL_KEY('z'):
+      editorUndo();
+      break;
+    case CTRL_KEY('y'):
+      editorRedo();
+      break;
     case BACKSPACE:
     case CTRL_KEY('h'):
     case DEL_KEY:
@@ -1023,8 +5367,13 @@ void editorProcessKeypress() {
       editorMoveCursor(c);
       break;
 
+    case PASTE_START:
+      editorPaste();
+      break;
+
     case CTRL_KEY('l'):
     case '\x1b':
+    case PASTE_END:
       break;
 
     default:
@@ -1042,7 +5391,33 @@ void init(){
     P.rowoff = 0;
     P.coloff = 0;
     P.numrows = 0;
-    P.row = NULL;
+    P.rows = NULL;
+    P.map = NULL;
+    P.mapsize = 0;
+    P.mapheap = 0;
+    P.lineoff = NULL;
+    P.linewrap = NULL;
+    P.nlinewrap = 0;
+    P.maplines = 0;
+    P.linestate = NULL;
+    P.linestatecap = 0;
+    P.indexer = NULL;
+    P.search = NULL;
+    P.save = NULL;
+    P.journal = NULL;
+    P.undo = (struct undoLog*) calloc(1, sizeof(struct undoLog));
+    P.undo -> last = (size_t) -1;
+    memset(&P.store, 0, sizeof(P.store));
+    P.trigram = NULL;
+    P.highlighter = NULL;
+    P.searchregex = 0;
+    P.frame = P.shadow = NULL;
+    P.framerows = P.framecols = 0;
+    P.shadowvalid = 0;
+    P.shadowrowoff = 0;
+    P.out.b = NULL;
+    P.out.len = P.out.cap = 0;
+    screenBuildSgr();
     P.filename = NULL;
     P.statusmsg[0] = '\0';
     P.statusmsg_time = 0;
@@ -1057,12 +5432,13 @@ void init(){
 int main(int argc, char *argv[]) {
   enableRawMode();
   init();
+  editorSetStatusMessage("HELP: Ctrl+S to save | Ctrl+Q to quit | Ctrl-F to Find | Ctrl-Z/Ctrl-Y to undo/redo");
   if (argc >= 2){
     editorOpen(argv[1]);
   }
-  editorSetStatusMessage("HELP: Ctrl+S to save | Ctrl+Q to quit | Ctrl-F to Find");
   while (1) {
-    editorRefreshScreen();
+    // Everything already typed is applied before the next frame is drawn.
+    if (!inputPending()) editorRefreshScreen();
     editorProcessKeypress();
   }
   return 0;
@@ -8,10 +8,17 @@ struct editorSyntax
   char *multiline_comment_start;
   char *multiline_comment_end;
   int flags;
+  struct syntaxLexer *lexer;
 };
 
 #define HL_HIGHLIGHT_NUMBERS (1 << 0)
 #define HL_HIGHLIGHT_STRINGS (1 << 1)
+// A single quote only opens a character literal, 'c' or '\c', and is left
+// alone when it is not closed right there, as in a Rust lifetime.
+#define HL_CHAR_LITERALS (1 << 2)
+// Quotes only open strings at the start of a word, so that an apostrophe
+// in a word such as "don't" does not.
+#define HL_QUOTES_START_WORDS (1 << 3)
 
 /*** filetypes ***/
 char *C_HL_extensions[] = {".c", ".h", ".cpp", NULL};
@@ -29,6 +36,42 @@ char *PY_HL_keywords[] = {"False", "None", "True", "and", "as", "assert",
 
 char *PY_HL_extensions[] = {".py", ".pyc", NULL};
 
+char *GO_HL_extensions[] = {".go", NULL};
+char *GO_HL_keywords[] = {
+    "break", "case", "chan", "const", "continue", "default", "defer", "else",
+    "fallthrough", "for", "func", "go", "goto", "if", "import", "interface",
+    "map", "package", "range", "return", "select", "struct", "switch", "type",
+    "var", "bool|", "byte|", "error|", "float32|", "float64|", "int|",
+    "int8|", "int16|", "int32|", "int64|", "rune|", "string|", "uint|",
+    "uint8|", "uint16|", "uint32|", "uint64|", "uintptr|", "true|", "false|",
+    "nil|", NULL};
+
+char *SH_HL_extensions[] = {".sh", ".bash", NULL};
+char *SH_HL_keywords[] = {
+    "if", "then", "else", "elif", "fi", "case", "esac", "for", "while",
+    "until", "do", "done", "in", "function", "select", "return", "break",
+    "continue", "local", "export", "readonly", "shift", "exit", "true|",
+    "false|", NULL};
+
+char *JSON_HL_extensions[] = {".json", NULL};
+char *JSON_HL_keywords[] = {"true|", "false|", "null|", NULL};
+
+char *YAML_HL_extensions[] = {".yaml", ".yml", NULL};
+char *YAML_HL_keywords[] = {
+    "true|", "false|", "True|", "False|", "TRUE|", "FALSE|", "yes|", "no|",
+    "on|", "off|", "null|", "Null|", "NULL|", NULL};
+
+char *RUST_HL_extensions[] = {".rs", NULL};
+char *RUST_HL_keywords[] = {
+    "as", "async", "await", "break", "const", "continue", "crate", "dyn",
+    "else", "enum", "extern", "fn", "for", "if", "impl", "in", "let", "loop",
+    "match", "mod", "move", "mut", "pub", "ref", "return", "self", "Self",
+    "static", "struct", "super", "trait", "type", "unsafe", "use", "where",
+    "while", "bool|", "char|", "str|", "String|", "i8|", "i16|", "i32|",
+    "i64|", "i128|", "isize|", "u8|", "u16|", "u32|", "u64|", "u128|",
+    "usize|", "f32|", "f64|", "Option|", "Result|", "Vec|", "Box|", "Some|",
+    "None|", "Ok|", "Err|", "true|", "false|", NULL};
+
 struct editorSyntax HLDB[] = {
     {"C/C++",
      C_HL_extensions,
@@ -40,4 +83,29 @@ struct editorSyntax HLDB[] = {
      PY_HL_keywords,
      "#", "/*", "*/",
      HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS},
+    {"Go",
+     GO_HL_extensions,
+     GO_HL_keywords,
+     "//", "/*", "*/",
+     HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS},
+    {"Shell",
+     SH_HL_extensions,
+     SH_HL_keywords,
+     "#", NULL, NULL,
+     HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS},
+    {"JSON",
+     JSON_HL_extensions,
+     JSON_HL_keywords,
+     NULL, NULL, NULL,
+     HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS},
+    {"YAML",
+     YAML_HL_extensions,
+     YAML_HL_keywords,
+     "#", NULL, NULL,
+     HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS | HL_QUOTES_START_WORDS},
+    {"Rust",
+     RUST_HL_extensions,
+     RUST_HL_keywords,
+     "//", "/*", "*/",
+     HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS | HL_CHAR_LITERALS},
 };
@@ -0,0 +1,86 @@
+// Checks that the lexer states the highlighter threads work out for a big
+// file, chunk by chunk with the fix-up pass, are the ones lexing it from
+// the top in one go gives. The file has comments spanning chunk
+// boundaries, one covering a whole chunk, and comment markers inside
+// strings and line comments. Run with `make test`.
+#define main pickle_main
+#include "../pickle.cpp"
+#undef main
+
+#define TEST_CHUNK PICKLE_HL_CHUNK
+#define TEST_LINES (4 * TEST_CHUNK + 1000)
+
+const char *testCode[] = {
+  "int value = 42; // not a /* comment",
+  "char *s = \"/* nor this\";",
+  "if (a < b) return a * b / 2;",
+  "x = y / *p; /* short */ z = 1;",
+  "",
+};
+
+// The line of the generated file at `l`.
+const char *testLine(int l) {
+  // Opens a few lines before the first boundary and closes after it.
+  if (l == TEST_CHUNK - 3) return "int a; /* opens before the boundary";
+  if (l > TEST_CHUNK - 3 && l < TEST_CHUNK + 5) return " * still inside";
+  if (l == TEST_CHUNK + 5) return " closes after it */ int b;";
+  // Opens on the last line of a chunk and covers all of the next one.
+  if (l == 2 * TEST_CHUNK - 1) return "x = 1; /* opens on the last line";
+  if (l > 2 * TEST_CHUNK - 1 && l < 3 * TEST_CHUNK + 2) return l & 1 ? " * \"quoted\" // and more" : " *";
+  if (l == 3 * TEST_CHUNK + 2) return "*/ y = 2;";
+  // A stray close at the start of a chunk, outside any comment.
+  if (l == 4 * TEST_CHUNK) return "*/ z = 3;";
+  return testCode[l % 5];
+}
+
+int main() {
+  char path[] = "/tmp/pickle-highlight-XXXXXX.c";
+  int fd = mkstemps(path, 2);
+  if (fd == -1) {
+    perror("mkstemps");
+    return 1;
+  }
+  FILE *f = fdopen(fd, "w");
+  for (int l = 0; l < TEST_LINES; l++) fprintf(f, "%s\n", testLine(l));
+  fclose(f);
+
+  P.screenrows = 22;
+  P.screencols = 80;
+  P.undo = (struct undoLog*) calloc(1, sizeof(struct undoLog));
+  P.undo -> last = (size_t) -1;
+  P.filename = strdup(path);
+  editorMapFile(path);
+  editorIndexWait();
+  editorSelectSyntaxHighlight();
+  if (P.highlighter == NULL) {
+    printf("FAIL: the highlighter threads did not start\n");
+    unlink(path);
+    return 1;
+  }
+  while (P.highlighter) {
+    editorHighlightPoll();
+    usleep(1000);
+  }
+
+  int bad = 0, in_comment = 0, inside = 0;
+  for (int l = 0; l < P.maplines; l++) {
+    if (P.linestate[l] != in_comment + 1) {
+      if (bad++ < 10) printf("line %d: state %d, expected %d\n", l, P.linestate[l], in_comment + 1);
+    }
+    if (in_comment) inside++;
+    int len;
+    char *s = editorFileLine(l, &len);
+    in_comment = editorLex(P.syntax -> lexer, s, len, NULL, in_comment);
+  }
+  unlink(path);
+
+  // The generated comments cover this many lines after their first.
+  int expected = 8 + TEST_CHUNK + 3;
+  if (inside != expected) {
+    printf("FAIL: %d lines start inside a comment, expected %d\n", inside, expected);
+    return 1;
+  }
+  printf("%s: %d lines, %d chunks, %d states wrong\n", bad ? "FAIL" : "ok", P.maplines,
+         (P.maplines + TEST_CHUNK - 1) / TEST_CHUNK, bad);
+  return bad != 0;
+}
@@ -0,0 +1,200 @@
+// Times editorUpdateSyntax, which matches keywords through the compiled
+// trie, over generated C and Python sources, a few passes each, and counts
+// the keyword runs it marks. Then times the lexer over the same lines
+// without highlighting them, as it goes over lines that are not loaded, and
+// checks that it ends every line in the same state. Then times the keyword
+// lookup alone at every word start against the linear scan over the keyword
+// list it replaced, and checks that both find the same keywords. Run with
+// `make bench`.
+#define main pickle_main
+#include "../pickle.cpp"
+#undef main
+
+#include <chrono>
+
+#define BENCH_PASSES 5
+
+double benchNow() {
+  return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Lines made of a template with a name and then a number filled in.
+char **benchSource(const char **templates, int ntemplates, int n) {
+  char **lines = (char**) malloc(sizeof(char*) * n);
+  unsigned int seed = 1;
+  for (int i = 0; i < n; i++) {
+    char name[16], buf[256];
+    seed = seed * 1103515245 + 12345;
+    snprintf(name, sizeof(name), "%c%c%s%u", 'a' + seed % 26, 'a' + (seed >> 8) % 26,
+             seed & 1 ? "_count" : "Item", (seed >> 16) % 100);
+    snprintf(buf, sizeof(buf), templates[i % ntemplates], name, (int) (seed % 1000));
+    lines[i] = strdup(buf);
+  }
+  return lines;
+}
+
+const char *benchC[] = {
+  "static int %s(struct node *n, unsigned long k) { // %d",
+  "  for (int i = 0; i < %s; i++) {",
+  "    if (n -> left == NULL && k > %s) return -%d;",
+  "    else if (%s) continue;",
+  "    double ratio = (double) %s / %d.5;",
+  "  switch (%s) { case 1: break; default: return %d; }",
+  "  /* keep %s around until %d */",
+  "  char *label = \"%s is %d\";",
+  "  while (%s --> 0) longest = (long) signed_value;",
+  "typedef struct %s { unsigned char flags[%d]; } node_t;",
+  "}",
+  "",
+};
+
+const char *benchPython[] = {
+  "def %s(self, items, limit=%d):",
+  "    for item in items:",
+  "        if item is None or not %s:",
+  "            continue",
+  "        elif item in self.seen and %s > limit:",
+  "            raise ValueError('%s went over %d')",
+  "    with open(%s) as f:",
+  "        return [x for x in f if x and %s]",
+  "    # yield %s lazily once it is %d",
+  "    try: import %s",
+  "    except ImportError: pass",
+  "",
+};
+
+// The keyword lookup editorUpdateSyntax did before the trie: every keyword
+// of the syntax compared in turn.
+int benchLinearMatch(char **keywords, const char *s, int *hl) {
+  for (int j = 0; keywords[j]; j++) {
+    int klen = strlen(keywords[j]);
+    int kw2 = keywords[j][klen - 1] == '|';
+    if (kw2) klen--;
+    if (!strncmp(s, keywords[j], klen) && is_separator(s[klen])) {
+      *hl = kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
+      return klen;
+    }
+  }
+  return 0;
+}
+
+// The lexer looks keywords up where a separator comes before; the trie
+// only when the byte there can start a keyword.
+int benchLookups(struct editorSyntax *syn, char **lines, int n) {
+  struct syntaxLexer *lx = syn -> lexer;
+  int nstarts = 0, cap = 1 << 16;
+  const char **starts = (const char**) malloc(sizeof(char*) * cap);
+  int *lens = (int*) malloc(sizeof(int) * cap);
+  for (int i = 0; i < n; i++) {
+    const char *end = lines[i] + strlen(lines[i]);
+    for (const char *p = lines[i]; *p; p++)
+      if ((p == lines[i] || is_separator(p[-1])) && !is_separator(*p)) {
+        if (nstarts == cap) {
+          cap *= 2;
+          starts = (const char**) realloc(starts, sizeof(char*) * cap);
+          lens = (int*) realloc(lens, sizeof(int) * cap);
+        }
+        starts[nstarts] = p;
+        lens[nstarts++] = end - p;
+      }
+  }
+
+  long found = 0, differ = 0;
+  for (int i = 0; i < nstarts; i++) {
+    int hl1 = 0, hl2 = 0, len1 = 0;
+    if (lx -> flags[(unsigned char) *starts[i]] & LX_KEYWORD)
+      len1 = keywordMatch(lx, starts[i], lens[i], &hl1);
+    int len2 = benchLinearMatch(syn -> keywords, starts[i], &hl2);
+    if (len1 != len2 || (len1 && hl1 != hl2)) differ++;
+    if (len1) found++;
+  }
+
+  // The lengths found are summed by one and taken off by the other, so both
+  // loops have a result to keep.
+  long sum = 0;
+  double t = benchNow();
+  for (int pass = 0; pass < BENCH_PASSES; pass++)
+    for (int i = 0; i < nstarts; i++) {
+      int hl;
+      if (lx -> flags[(unsigned char) *starts[i]] & LX_KEYWORD) sum += keywordMatch(lx, starts[i], lens[i], &hl);
+    }
+  double trie = (benchNow() - t) / BENCH_PASSES;
+  t = benchNow();
+  for (int pass = 0; pass < BENCH_PASSES; pass++)
+    for (int i = 0; i < nstarts; i++) {
+      int hl;
+      sum -= benchLinearMatch(syn -> keywords, starts[i], &hl);
+    }
+  double linear = (benchNow() - t) / BENCH_PASSES;
+
+  printf("%-8s %7d word starts  linear %8.2f ms  trie %8.2f ms  %ld keywords%s\n", syn -> filetype,
+         nstarts, linear, trie, found, differ || sum ? "  MISMATCH" : "");
+  free(starts);
+  free(lens);
+  return differ != 0 || sum != 0;
+}
+
+int benchSyntax(const char *ext, const char **templates, int ntemplates, int n) {
+  P.syntax = NULL;
+  for (unsigned int j = 0; j < HLDB_ENTRIES && P.syntax == NULL; j++)
+    for (int i = 0; HLDB[j].filematch[i]; i++)
+      if (strcmp(HLDB[j].filematch[i], ext) == 0) P.syntax = &HLDB[j];
+  if (P.syntax == NULL) {
+    printf("no syntax for %s\n", ext);
+    return 1;
+  }
+  if (P.syntax -> lexer == NULL) P.syntax -> lexer = syntaxCompile(P.syntax);
+
+  char **lines = benchSource(templates, ntemplates, n);
+  erow *rows = (erow*) calloc(n, sizeof(erow));
+  size_t bytes = 0;
+  for (int i = 0; i < n; i++) {
+    rows[i].render = lines[i];
+    rows[i].rsize = strlen(lines[i]);
+    bytes += rows[i].rsize;
+  }
+
+  double t = benchNow();
+  for (int pass = 0; pass < BENCH_PASSES; pass++) {
+    int in_comment = 0;
+    for (int i = 0; i < n; i++) {
+      editorUpdateSyntax(&rows[i], in_comment);
+      in_comment = rows[i].hl_open_comment;
+    }
+  }
+  double ms = (benchNow() - t) / BENCH_PASSES;
+  t = benchNow();
+  long differ = 0;
+  for (int pass = 0; pass < BENCH_PASSES; pass++) {
+    int in_comment = 0;
+    for (int i = 0; i < n; i++) {
+      in_comment = editorLex(P.syntax -> lexer, lines[i], rows[i].rsize, NULL, in_comment);
+      if (in_comment != rows[i].hl_open_comment) differ++;
+    }
+  }
+  double scan = (benchNow() - t) / BENCH_PASSES;
+
+  long keywords = 0;
+  for (int i = 0; i < n; i++)
+    for (int k = 0; k < rows[i].nhl; k++)
+      if (rows[i].hl[k].hl == HL_KEYWORD1 || rows[i].hl[k].hl == HL_KEYWORD2) keywords++;
+  printf("%-8s %7d lines %6.1f MB  %8.2f ms per pass  %6.0f MB/s  unmarked %6.0f MB/s  %ld keywords%s\n",
+         P.syntax -> filetype, n, bytes / 1048576.0, ms, bytes / 1048576.0 / (ms / 1000),
+         bytes / 1048576.0 / (scan / 1000), keywords, differ ? "  MISMATCH" : "");
+  int bad = benchLookups(P.syntax, lines, n);
+
+  for (int i = 0; i < n; i++) {
+    storeFree(rows[i].hl, rows[i].hlcap);
+    free(lines[i]);
+  }
+  free(rows);
+  free(lines);
+  return bad || keywords == 0 || differ != 0;
+}
+
+int main() {
+  int bad = 0;
+  bad |= benchSyntax(".c", benchC, sizeof(benchC) / sizeof(benchC[0]), 200000);
+  bad |= benchSyntax(".py", benchPython, sizeof(benchPython) / sizeof(benchPython[0]), 200000);
+  return bad;
+}
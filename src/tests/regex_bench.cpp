@@ -0,0 +1,93 @@
+// Times the regex engine of find against std::regex (POSIX extended, which
+// has the same leftmost-longest matches) over a generated log, and checks
+// that both find the same matches. Run with `make bench`.
+#define main pickle_main
+#include "../pickle.cpp"
+#undef main
+
+#include <regex>
+#include <chrono>
+
+#define BENCH_LINES 100000
+
+double benchNow() {
+  return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct benchCount {
+  long matches;
+  long bytes;
+};
+
+void benchFound(void *arg, int col, int len) {
+  struct benchCount *c = (struct benchCount*) arg;
+  c -> matches++;
+  c -> bytes += len;
+}
+
+// A log line in every 50 carries an ERROR with a request id.
+char **benchLog(int n) {
+  char **lines = (char**) malloc(sizeof(char*) * n);
+  unsigned int seed = 1;
+  for (int i = 0; i < n; i++) {
+    char buf[256];
+    seed = seed * 1103515245 + 12345;
+    if (i % 50 == 0)
+      snprintf(buf, sizeof(buf), "2020-01-21 10:%02d:%02d ERROR worker-%d failed req_id=%08x after %d ms", i / 60 % 60, i % 60, i % 16, seed, i % 997);
+    else
+      snprintf(buf, sizeof(buf), "2020-01-21 10:%02d:%02d INFO worker-%d served /api/v1/items/%u in %d ms", i / 60 % 60, i % 60, i % 16, seed % 100000, i % 997);
+    lines[i] = strdup(buf);
+  }
+  return lines;
+}
+
+int benchPattern(const char *pattern, char **lines, int n) {
+  const char *err;
+  rxProgram *rx = rxCompilePattern(pattern, &err);
+  if (rx == NULL) {
+    printf("%s: %s\n", pattern, err);
+    return 1;
+  }
+  unsigned char *starts = (unsigned char*) malloc(4096);
+  struct benchCount dfa = {0, 0};
+  double t = benchNow();
+  for (int i = 0; i < n; i++) rxLineMatches(rx, lines[i], strlen(lines[i]), starts, benchFound, &dfa);
+  double tdfa = benchNow() - t;
+
+  std::regex re(pattern, std::regex::extended);
+  struct benchCount lib = {0, 0};
+  t = benchNow();
+  for (int i = 0; i < n; i++) {
+    const char *s = lines[i];
+    for (std::cregex_iterator it(s, s + strlen(s), re), end; it != end; ++it) {
+      lib.matches++;
+      lib.bytes += it -> length();
+    }
+  }
+  double tstd = benchNow() - t;
+
+  int bad = dfa.matches != lib.matches || dfa.bytes != lib.bytes;
+  printf("%-28s %6d lines  dfa %9.2f ms  std::regex %9.2f ms  %ld matches%s\n",
+         pattern, n, tdfa, tstd, dfa.matches, bad ? "  MISMATCH" : "");
+  free(starts);
+  rxFree(rx);
+  return bad;
+}
+
+int main() {
+  char **lines = benchLog(BENCH_LINES);
+  int bad = 0;
+  bad |= benchPattern("ERROR.*req_id=[0-9a-f]{8}", lines, BENCH_LINES);
+  bad |= benchPattern("worker-(1[0-5]|[3-7])", lines, BENCH_LINES);
+  bad |= benchPattern("items/[0-9]+ in [0-9]{3} ms", lines, BENCH_LINES);
+
+  // Backtracking engines take exponential time here; the DFA stays linear.
+  char *hard[9];
+  for (int i = 0; i < 9; i++) {
+    hard[i] = (char*) malloc(29);
+    memset(hard[i], 'a', 28);
+    hard[i][28] = '\0';
+  }
+  bad |= benchPattern("(a|aa)*c", hard, 9);
+  return bad;
+}